@@ -45,10 +45,50 @@
 #else
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #endif
 
 #include "clamma.h"
 
+/*
+ * Minimal atomics for the lockless paths, these are full barriers.
+ * clamma_atomic_add() returns the value before the add.
+ */
+
+typedef long clamma_atomic_t;
+typedef int64_t clamma_atomic64_t;
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define clamma_atomic_add(p, v)		_InterlockedExchangeAdd((volatile long *)(p), (long)(v))
+#define clamma_atomic_add64(p, v)	_InterlockedExchangeAdd64((volatile __int64 *)(p), (__int64)(v))
+#define clamma_atomic_load(p)		_InterlockedOr((volatile long *)(p), 0)
+#define clamma_atomic_load64(p)		_InterlockedOr64((volatile __int64 *)(p), 0)
+#define clamma_atomic_store(p, v)	_InterlockedExchange((volatile long *)(p), (long)(v))
+#define clamma_atomic_store64(p, v)	_InterlockedExchange64((volatile __int64 *)(p), (__int64)(v))
+#define clamma_atomic_xchg(p, v)	_InterlockedExchange((volatile long *)(p), (long)(v))
+#define clamma_atomic_cas(p, o, n)	(_InterlockedCompareExchange((volatile long *)(p), (long)(n), (long)(o)) == (long)(o))
+#define clamma_atomic_cas64(p, o, n)	(_InterlockedCompareExchange64((volatile __int64 *)(p), (__int64)(n), (__int64)(o)) == (__int64)(o))
+#define clamma_cpu_relax()		YieldProcessor()
+#else
+#define clamma_atomic_add(p, v)		__atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define clamma_atomic_add64(p, v)	__atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define clamma_atomic_load(p)		__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define clamma_atomic_load64(p)		__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define clamma_atomic_store(p, v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define clamma_atomic_store64(p, v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define clamma_atomic_xchg(p, v)	__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#define clamma_atomic_cas(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#define clamma_atomic_cas64(p, o, n)	__sync_bool_compare_and_swap(p, o, n)
+#if defined(__x86_64__) || defined(__i386__)
+#define clamma_cpu_relax()		__builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define clamma_cpu_relax()		__asm__ __volatile__("yield")
+#else
+#define clamma_cpu_relax()		do { } while (0)
+#endif
+#endif
+
 /*
  * The supported types of quantized model files
  */
@@ -126,16 +166,84 @@ typedef struct {
 	qt_t		xq; // quantized x (dim,)
 	qt_t		hq; // quantized hb (hidden_dim,)
 	float		*q; // query (dim,)
-	float		*k; // key (dim,)
-	float		*v; // value (dim,)
 	float		*att; // buffer for scores/attention values (n_heads, seq_len)
 
 #if defined(LIBCLAMMA_SMP)
 	clamma_sem_t	sem_done;
-	int		queued;
+	/*
+	 * Twice the chunks of our ops not completed yet, bit 0 is set while
+	 * the owner sleeps on sem_done
+	 */
+	clamma_atomic_t	queued;
+	unsigned long	ops[8]; /* ring indexes of our ops since last sync */
+	unsigned int	nops;
+	struct clamma_pool *pool; /* whose workers do our ops */
 #endif
 } txf_session_state_t;
 
+/*
+ * One layer of the forward pass as a static graph of ops, built from the
+ * config at construct.  Matmuls are split into fixed tiles of rows, RoPE and
+ * attention into heads, so each op only waits on the ops producing what it
+ * reads, rather than on everything issued before it.  Each node's successors
+ * are node[].nsucc entries in succ[], from node[].succ.
+ */
+
+#define CLAMMA_GRAPH_TILE_ROWS		64
+
+typedef enum {
+	CLAMMA_GOP_RMSNORM,	/* xb <- rmsnorm(x), a: 0 attention, 1 ffn */
+	CLAMMA_GOP_QUANTIZE,	/* a: 0 xq <- xb, 1 xq <- xb2, 2 hq <- hb */
+	CLAMMA_GOP_MATMUL,	/* rows a .. b of matrix m */
+	CLAMMA_GOP_ROPE,	/* head a of q, and of k if it's a kv head */
+	CLAMMA_GOP_ATTN,	/* head a into xb2 */
+	CLAMMA_GOP_SWIGLU,	/* rows a .. b of hb */
+	CLAMMA_GOP_JOIN,	/* nothing, just gathers deps */
+	CLAMMA_GOP_RESIDUAL,	/* x += xb */
+} clamma_gop_t;
+
+typedef enum {
+	CLAMMA_GMAT_WQ,
+	CLAMMA_GMAT_WK,
+	CLAMMA_GMAT_WV,
+	CLAMMA_GMAT_WO,
+	CLAMMA_GMAT_W1,
+	CLAMMA_GMAT_W3,
+	CLAMMA_GMAT_W2,
+} clamma_gmat_t;
+
+typedef struct {
+	uint8_t		op; /* clamma_gop_t */
+	uint8_t		m; /* clamma_gmat_t */
+	uint32_t	a;
+	uint32_t	b;
+	uint32_t	ndeps;
+	uint32_t	succ;
+	uint32_t	nsucc;
+} clamma_gnode_t;
+
+typedef struct {
+	clamma_gnode_t	*node;
+	uint32_t	*succ;
+	unsigned int	nnodes;
+} clamma_graph_t;
+
+/*
+ * A session's way through the graph for one layer.  Each node goes on the
+ * ready FIFO once per layer, when the last node it waits on completes.
+ */
+
+typedef struct {
+	clamma_atomic_t	*pending; /* nodes each node still waits on */
+	clamma_atomic_t	*ready; /* node + 1, or 0 until it's pushed */
+	clamma_atomic_t	head; /* next ready to be taken */
+	clamma_atomic_t	tail; /* next ready to be pushed */
+	clamma_atomic_t	done; /* nodes completed */
+	clamma_atomic_t	failed;
+	unsigned int	layer;
+	int		pos;
+} clamma_graph_run_t;
+
 typedef struct {
 	// current wave of activations
 	float		*x; // activation at current time stamp (dim,)
@@ -148,24 +256,267 @@ typedef struct {
 
 	/* the session-local part of the state */
 	txf_session_state_t tss;
+	clamma_graph_run_t g;
 } txf_state_t;
 
+/*
+ * A weight extent in the model, layers are described by a list of these in
+ * the order the forward pass uses them, see clamma_layer_weights()
+ */
+
+#define CLAMMA_LAYER_WEIGHTS_MAX	16
+
+/* what kind of tensor a weight extent belongs to, for the cache stats */
+
+typedef enum {
+	CLAMMA_WCLASS_OTHER, /* eg, token embeddings */
+	CLAMMA_WCLASS_RMS,
+	CLAMMA_WCLASS_WQ,
+	CLAMMA_WCLASS_WK,
+	CLAMMA_WCLASS_WV,
+	CLAMMA_WCLASS_WO,
+	CLAMMA_WCLASS_W1,
+	CLAMMA_WCLASS_W2,
+	CLAMMA_WCLASS_W3,
+	CLAMMA_WCLASS_CLS,
+
+	CLAMMA_WCLASS_COUNT
+} clamma_wclass_t;
+
+typedef struct clamma_wref {
+	const void	*p;
+	size_t		len;
+	uint8_t		cls; /* clamma_wclass_t */
+} clamma_wref_t;
+
+/*
+ * MALLOC_CACHE mode weight cache entry, the cached weights are in a block
+ * from the model's arena.
+ *
+ * Entries are found by (offset, len) in a hash table with a lock per bucket,
+ * and are also on a ring that a CLOCK hand sweeps over to choose what to evict.
+ * A kernel pins the entries it uses for the duration, pinned entries are never
+ * evicted.
+ */
+
+#define CLAMMA_CWC_HASH		1024
+#define CLAMMA_DIRECT_ALIGN	4096 /* O_DIRECT buffer, offset and length */
+#define CLAMMA_CWC_NO_LAYER	0xffff
+
 typedef struct cwc {
-	struct cwc	*next;
+	struct cwc	*hnext; /* hash bucket chain */
+	struct cwc	*cprev; /* clock ring */
+	struct cwc	*cnext;
 	uint64_t	offset;
 	size_t		len;
-	unsigned int	count;
+	uint8_t		*data; /* the weights */
+	uint8_t		*buf; /* what is read from disk, aligned for O_DIRECT */
+	size_t		rlen;
+	void		*blk; /* arena block holding buf */
+	uint16_t	layer; /* CLAMMA_CWC_NO_LAYER if not part of one */
+	uint8_t		cls; /* clamma_wclass_t */
+	clamma_atomic_t	refcount; /* pins held by users of the entry */
+	clamma_atomic_t	referenced; /* clock bit, set on every hit */
+	clamma_atomic_t	ready; /* 1 = loaded, -1 = load failed */
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_t	mut_load; /* held by the loader until ready */
+#endif
 } cwc_t;
 
+typedef struct cwc_bucket {
+	cwc_t		*head;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_t	mut;
+#endif
+} cwc_bucket_t;
+
+/*
+ * Out-of-core streaming: two slabs each big enough for one layer's weights,
+ * one is filled from disk while the forward pass runs from the other
+ */
+
+typedef struct cws_slab {
+	uint8_t		*buf;
+	clamma_wref_t	w[CLAMMA_LAYER_WEIGHTS_MAX];
+	size_t		ofs[CLAMMA_LAYER_WEIGHTS_MAX]; /* of each w in buf */
+	unsigned int	count;
+	int		stage; /* layer it holds, -1 = none */
+	uint64_t	seq; /* order it was asked for in */
+	clamma_atomic_t	ready; /* 1 = filled, -1 = fill failed */
+	clamma_atomic_t	refcount;
+#if defined(LIBCLAMMA_SMP)
+	clamma_atomic_t	draining; /* someone waits on sem_idle for refs to go */
+	clamma_sem_t	sem_idle;
+	unsigned int	ready_waiters; /* on sem_ready, under mut_stream */
+	clamma_sem_t	sem_ready;
+#endif
+} cws_slab_t;
+
+/*
+ * Cache entry weights come from an arena per model.  Blocks of one size, in
+ * practice one kind of tensor, are carved from chunks of their own that are
+ * 2MB aligned so they can be backed by hugepages.  Freed blocks go on a free
+ * list for their size to be reused, a chunk that becomes completely free is
+ * unmapped unless it's the size's one spare.  Once every class is taken, a
+ * new size is rounded up to the closest bigger class.
+ */
+
+#define CLAMMA_CWA_CHUNK	(2 * 1024 * 1024)
+#define CLAMMA_CWA_HDR		4096 /* chunk header, keeps blocks aligned */
+#define CLAMMA_CWA_CLASSES	32
+
+typedef struct cwa_free {
+	struct cwa_free	*prev;
+	struct cwa_free	*next;
+} cwa_free_t;
+
+typedef struct cwa_chunk {
+	struct cwa_class *cls; /* NULL if the chunk is one odd-sized block */
+	struct cwa_chunk *next; /* class's chunks, the first is being carved */
+	struct cwa_chunk *prev;
+	size_t		len; /* of the mapping */
+	size_t		size; /* of the blocks */
+	unsigned int	blocks; /* how many fit */
+	unsigned int	carved;
+	unsigned int	used;
+} cwa_chunk_t;
+
+typedef struct cwa_class {
+	size_t		size; /* block size, 0 = class not used yet */
+	cwa_free_t	*free;
+	cwa_chunk_t	*chunks;
+	cwa_chunk_t	*spare; /* free chunk kept for reuse */
+} cwa_class_t;
+
+typedef struct cwa {
+	cwa_class_t	cls[CLAMMA_CWA_CLASSES];
+	uint64_t	mapped;
+	uint64_t	in_use;
+	uint64_t	free; /* on the free lists */
+	uint64_t	allocs;
+	uint64_t	reused;
+	uint8_t		warned; /* ran out of classes */
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_t	mut;
+#endif
+} cwa_t;
+
+/*
+ * Which layer and class each weight extent is, sorted by file offset
+ */
+
+typedef struct cwc_ix {
+	uint64_t	ofs;
+	size_t		len;
+	uint16_t	layer;
+	uint8_t		cls;
+} cwc_ix_t;
+
+/*
+ * Weight cache stats for one class of tensor, or a whole model.  Hits are
+ * kernel lookups that found the weights loaded, misses are ones that had to
+ * wait for them to come from disk.
+ */
+
+typedef struct clamma_wc_class_stats {
+	uint64_t	hits;
+	uint64_t	misses;
+	uint64_t	bytes_read;
+	uint64_t	evictions;
+	uint64_t	resident; /* bytes cached now */
+	uint64_t	stall_ns; /* kernels waiting on misses */
+} clamma_wc_class_stats_t;
+
+typedef struct clamma_wc_stats {
+	clamma_wc_class_stats_t	cls[CLAMMA_WCLASS_COUNT];
+	clamma_wc_class_stats_t	total;
+	uint64_t	lock_wait_ns; /* taking the cache locks */
+	uint64_t	cache_limit;
+	uint64_t	arena_mapped;
+	unsigned int	entries;
+	unsigned int	pinned_layers;
+} clamma_wc_stats_t;
+
+/*
+ * One read of a batch, see cwc_read_batch()
+ */
+
+typedef struct cwc_read {
+	void		*dst;
+	uint64_t	ofs;
+	size_t		len;
+	size_t		need; /* less than len if it may hit EOF */
+	void		*opaque;
+	int		result; /* 0 = read ok */
+} cwc_read_t;
+
+/*
+ * io_uring for batched reads on Linux, fd is -1 if we don't have one
+ */
+
+#define CLAMMA_CWC_RING_DEPTH	32
+
+typedef struct cwc_ring {
+	int		fd;
+	unsigned int	entries;
+	unsigned int	*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int	*cq_head, *cq_tail, *cq_mask;
+	void		*sqes, *cqes;
+	void		*sq_map, *cq_map;
+	size_t		sq_map_len, cq_map_len, sqes_len;
+} cwc_ring_t;
+
+#if defined(LIBCLAMMA_SMP)
+typedef struct cwc_prefetch {
+	pthread_t	pt;
+	clamma_sem_t	sem;
+	clamma_mutex_t	mut;
+	const struct txf *t; /* pending request, or NULL */
+	const struct txf *busy; /* the model being prefetched now */
+	unsigned int	layer;
+	char		running;
+	char		exiting;
+} cwc_prefetch_t;
+#endif
+
 typedef struct cwc_state {
-	cwc_t		*cwc_head;
+	cwc_bucket_t	bucket[CLAMMA_CWC_HASH];
+	cwc_t		*hand; /* clock hand, NULL when the ring is empty */
+	unsigned int	count;
 	int		cwc_created;
 	uint64_t	cwc_fetched;
 	uint64_t	cwc_touched;
 	uint64_t	cwc_alloced;
+	uint64_t	cwc_evicted;
+	uint64_t	cwc_prefetched;
+	uint64_t	cwc_prefetch_skipped;
+	uint64_t	cwc_stalls; /* kernel waited on disk */
+	uint64_t	cwc_stall_ns;
+
+	cws_slab_t	slab[2];
+	size_t		slab_size;
+	uint64_t	stream_seq;
+	uint64_t	stream_bytes;
+	uint64_t	stream_ns;
+
+	cwc_ring_t	ring;
+	char		ring_broken; /* fall back to pread() from now on */
+
+	cwa_t		arena;
+
+	cwc_ix_t	*ix;
+	unsigned int	ix_count;
+	uint8_t		*pin; /* per layer, n_layers + 1 for the classifier */
+
+	clamma_wc_class_stats_t cs[CLAMMA_WCLASS_COUNT];
+	uint64_t	lock_wait_ns;
 
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_t mut_cwc;
+	cwc_prefetch_t	pf;
+	clamma_mutex_t mut_cwc; /* clock ring, eviction and accounting */
+	clamma_mutex_t mut_fd; /* _WIN32 has no pread() */
+	clamma_mutex_t mut_stream; /* slab assignment */
+	clamma_mutex_t mut_pass; /* one forward pass at a time when streaming */
 #endif
 } cwc_state_t;
 
@@ -191,19 +542,79 @@ typedef struct txf_session {
 
 	size_t		pos;
 	size_t		limit;
-	size_t		ct;
+	size_t		kv_max; /* positions the kv cache was reserved for */
+	size_t		reserved; /* bytes charged to the model's budget */
+	size_t		ct; /* absolute pos where the prompt tokens end */
+	size_t		tbase; /* absolute pos of tokens[0] */
 	tok_id_t	token;
 	tok_id_t	tnext;
 	tok_id_t	*tokens;
 	uint64_t	token_count;
 	uint64_t	start;
+	uint64_t	majflt; /* process major faults during our forward passes */
 
 	issue_cb_t	issue_cb;
 	void		*opaque_user_pointer;
 	void		**null_on_destroy;
 	char		client_gone;
+	char		persist; /* keep session (and kv cache) after turn */
+	char		idle; /* persistent session waiting for next turn */
+	char		held; /* being set up or stepped, under mut_sessions */
+	char		stepping; /* held by a stepping thread, ditto */
+	char		utf8[16]; /* our decoded pieces */
 } txf_session_t;
 
+/* why clamma_session_construct_admit() did or didn't make a session */
+
+typedef enum {
+	CLAMMA_ADMIT_OK,
+	CLAMMA_ADMIT_MAX_SESSIONS, /* the model's max_sessions are in use */
+	CLAMMA_ADMIT_BUDGET, /* the footprint doesn't fit in what's left */
+	CLAMMA_ADMIT_NOMEM, /* it fit, but allocation failed */
+
+	CLAMMA_ADMIT_COUNT
+} clamma_admit_t;
+
+/*
+ * LRU cache of encoded prompt segments, eg, chat template pieces and system
+ * prompts, so they don't have to be re-encoded for every query
+ */
+
+#define CLAMMA_VOCAB_SEGMENT_CACHE_DEFAULT	32
+#define CLAMMA_VOCAB_SEGMENT_CACHE_HASH		64
+
+typedef struct vsc {
+	struct vsc	*hnext; /* hash bucket chain */
+	struct vsc	*prev; /* lru list, head is most recently used */
+	struct vsc	*next;
+	uint64_t	hash;
+	size_t		n_tokens;
+	size_t		text_len;
+	int8_t		key; /* dummy prefix, and the tokens ahead (up to 2) */
+	/* followed by tok_id_t tokens[n_tokens], then the text */
+} vsc_t;
+
+typedef struct vsc_state {
+	vsc_t		*hash[CLAMMA_VOCAB_SEGMENT_CACHE_HASH];
+	vsc_t		*lru_head;
+	vsc_t		*lru_tail;
+	unsigned int	count;
+	unsigned int	limit;
+	uint64_t	hits;
+	uint64_t	misses;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_t	mut_vsc;
+#endif
+} vsc_state_t;
+
+/* one piece of a prompt, the template pieces are marked cacheable */
+
+typedef struct vseg {
+	const char	*text;
+	char		cache;
+} vseg_t;
+
 typedef struct tidx {
 	char		*str;
 	tok_id_t	id;
@@ -216,9 +627,45 @@ typedef struct vocab {
 	size_t		size;
 	size_t		storage_size;
 	uint32_t	max_token_length;
+	vsc_state_t	*vsc;
+	struct clamma_pool *pool; /* for batch ops, the model's if it has one */
 	char		utf8[16]; /* for <0xAB[CD]> format conversion */
 } txf_vocab_t;
 
+/*
+ * A batch encode or decode operation over many texts, split into ranges of
+ * documents so it can be spread over the worker threads
+ */
+
+typedef struct vocab_batch {
+	const txf_vocab_t	*v;
+	const char * const	*texts; /* encode: input texts */
+	tok_id_t		*tokens; /* encode: out, decode: in */
+	const size_t		*offsets; /* start of each document's slot */
+	size_t			*lens; /* out: used length of each slot */
+	char			*text; /* decode: out */
+	int8_t			bos;
+	int8_t			eos;
+	clamma_atomic_t		failed; /* a worker's range couldn't be done */
+} vocab_batch_t;
+
+#define CLAMMA_NUMA_MAX		8
+
+/*
+ * Header of a shared model segment, the model file image follows at
+ * CLAMMA_SHM_HDR, then any derived tables
+ */
+
+#define CLAMMA_SHM_HDR		4096
+#define CLAMMA_SHM_MAGIC	0x43534d31 /* "CSM1" */
+
+typedef struct {
+	clamma_atomic_t	ready; /* CLAMMA_SHM_MAGIC when complete */
+	uint64_t	file_size;
+	uint64_t	emb_ofs; /* dequantized embeddings, or 0 */
+	txf_config_t	c; /* must match the attacher's */
+} clamma_shm_hdr_t;
+
 typedef struct txf {
 	txf_config_t	c;
 	txf_weights_t	w;
@@ -229,6 +676,10 @@ typedef struct txf {
 	void		*model_base;
 	size_t		model_size;
 	size_t		cache_limit;
+	cwc_state_t	*cwc; /* MALLOC_CACHE weight cache */
+	char		prefetch; /* MALLOC_CACHE layer-ahead prefetch */
+	char		stream; /* MALLOC_CACHE double-buffered layer slabs */
+	char		direct; /* MALLOC_CACHE reads bypass the page cache */
 
 	unsigned int	max_sessions;
 	char		name[33];
@@ -236,10 +687,62 @@ typedef struct txf {
 
 	int		fd;
 	float		*data;
+	void		*huge; /* MMAP mode model image on hugepages */
+	size_t		huge_len;
+	char		huge_tlb; /* huge is from hugetlbfs */
+
+	/* per-node replicas of the image at numa_base, for the workers */
+	uint8_t		*numa_copy[CLAMMA_NUMA_MAX];
+	const uint8_t	*numa_base;
+	size_t		numa_len;
+
+	const uint8_t	*shm; /* attached shared segment, if any */
+	size_t		shm_len;
+
+	struct clamma_pool *pool; /* the threads doing our ops, if SMP */
+	clamma_graph_t	graph; /* one layer of the forward pass */
+
+	/* under mut_sessions */
+	void		*sess_pool; /* freed session blocks */
+	size_t		sess_budget; /* bytes sessions may reserve, 0 = any */
+	size_t		sess_reserved;
+	unsigned int	sess_count;
+	char		locked; /* model image is mlock()ed */
 	unsigned int	d_ofs;
 	ssize_t		file_size;
 } txf_t;
 
+/*
+ * The extents of the quantized weights fetched by a (n, d) matmul_qt, these
+ * are also the weight cache keys
+ */
+
+static inline size_t
+qt_q_len(const txf_t *t, int n, int d)
+{
+	return (size_t)(d * n) + (t->c.group_size * n);
+}
+
+static inline size_t
+qt_s_len(const txf_t *t, int n, int d)
+{
+	return ((size_t)(d * n) / t->c.group_size) * sizeof(float);
+}
+
+/* layer n_layers is the final rmsnorm and classifier */
+
+unsigned int
+clamma_layer_weights(const txf_t *t, unsigned int l, clamma_wref_t *w);
+
+int
+clamma_graph_build(txf_t *t);
+
+void
+clamma_graph_destroy(txf_t *t);
+
+void
+clamma_graph_run(txf_state_t *s, int node, unsigned long op);
+
 int
 _session_matmul(txf_session_state_t *tss,    float *xout, const float *x,
 		const float *w1, int i, int dlim, int n, int d);
@@ -248,14 +751,46 @@ int
 _session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
 		   const qt_t *w1, int i, int dlim, int n, int d);
 
-#if defined(LIBCLAMMA_SMP)
-
 typedef enum {
 	CLAMMA_JOB_MATMUL,
-	CLAMMA_JOB_MATMUL_QT
+	CLAMMA_JOB_MATMUL_QT,
+	CLAMMA_JOB_VOCAB_ENCODE,
+	CLAMMA_JOB_VOCAB_DECODE,
+	CLAMMA_JOB_PREFAULT,
+	CLAMMA_JOB_GRAPH
 } clamma_job_type_t;
 
+/* how clamma_smp_affinity() places the worker threads and stepping thread */
+
+typedef enum {
+	CLAMMA_AFFINITY_NONE, /* unpinned, or pinned per NUMA node */
+	CLAMMA_AFFINITY_CORES, /* one thread per physical core, no SMT sibling */
+	CLAMMA_AFFINITY_CPUS, /* one thread per cpu in an explicit list */
+	CLAMMA_AFFINITY_ISOLATED, /* one thread per isolcpus= cpu */
+} clamma_affinity_t;
+
+#if defined(LIBCLAMMA_SMP)
+
+/*
+ * An op queued for the workers, split into nchunks chunks of rows (or docs,
+ * or bytes) that are dealt out in contiguous runs, one part per worker plus
+ * one for the session thread.  Each part holds the generation of the op in
+ * the slot (its ring index + 1) in the top 32 bits, then the end and the next
+ * chunk of the run in 16 bits each.  The owner of a part claims from the
+ * front by adding 1, and once it's out, steals from the back of the others'
+ * parts by taking 1 off their end.  gen is set last, once the op is ready.
+ */
+
+#define CLAMMA_JOB_MAX_CHUNKS		4096
+#define CLAMMA_JOB_MAX_PARTS		64
+#define CLAMMA_JOB_CHUNKS_PER_PART	8
+#define CLAMMA_JOB_MIN_ROWS		16 /* smallest matmul chunk */
+
 typedef struct job {
+	clamma_atomic64_t	part[CLAMMA_JOB_MAX_PARTS];
+	clamma_atomic_t		gen;
+	clamma_atomic_t		left; /* chunks not yet completed */
+
 	txf_session_state_t	*tss;
 	clamma_job_type_t	type;
 
@@ -264,39 +799,91 @@ typedef struct job {
 	const float		*w1;
 	const qt_t		*qt_x;
 	const qt_t		*qt_w;
-	int			i;
+	vocab_batch_t		*vb;
+	const uint8_t		*mem; /* prefault range */
 	int			n;
 	int			d;
-	int			dlim;
+	int			chunk; /* per chunk, the last one gets the rest */
+	int			end;
+	unsigned int		nchunks;
+	unsigned int		nparts;
 } job_t;
 
-typedef struct work {
-	clamma_mutex_t mut_job;
+/* the op counters wrap, which only keeps to the ring slots for a power of 2 */
+#if !LIBCLAMMA_MAX_THREAD_JOB_QUEUE || \
+    (LIBCLAMMA_MAX_THREAD_JOB_QUEUE & (LIBCLAMMA_MAX_THREAD_JOB_QUEUE - 1))
+#error LIBCLAMMA_MAX_THREAD_JOB_QUEUE must be a power of 2
+#endif
 
+typedef struct work {
 	job_t		job_ring[LIBCLAMMA_MAX_THREAD_JOB_QUEUE];
 
-	int		job_head;
-	int		job_tail;
+	clamma_atomic_t	job_head; /* ops reserved by producers so far */
 } work_t;
 
 typedef struct work_threads {
+	struct clamma_pool *pool;
 	pthread_t	pt;
 	clamma_sem_t	sem_start;
+	clamma_atomic_t	sleeping; /* waiting on sem_start for new ops */
+	unsigned long	cursor; /* next op index to look at */
+	unsigned int	node; /* index of the NUMA node it's pinned to */
+	clamma_atomic64_t busy_ns; /* time spent doing chunks */
+	clamma_atomic64_t chunks; /* chunks done */
+	clamma_atomic64_t steals; /* ... of which were from others' parts */
+	char		*scratch; /* per-thread tokenizer scratch */
+	size_t		scratch_len;
+	clamma_atomic_t	exiting; /* the pool is going away */
 	char		running;
-	char		exiting;
 } work_threads_t;
 
+/*
+ * A pool of worker threads with its own job ring.  Models use the one made for
+ * them at construct by default, but can be attached to another, so several
+ * models may share one, or models can be given pools sized and placed to suit
+ * them.  The pool goes away when the last of its creator and the models
+ * attached to it let go.
+ */
 
-extern work_threads_t *work_threads;
-extern work_t work;
-extern unsigned int count_threads, thread_init_refcount;
+typedef struct clamma_pool {
+	work_t		work;
+	work_threads_t	*threads;
+	unsigned int	count;
+	clamma_atomic_t	refcount;
+
+	/* cpus from the affinity policy when the pool was made, if it places */
+	clamma_affinity_t affinity;
+	int		*place_cpu; /* stepping threads', then the workers' */
+	unsigned int	place_count;
+	unsigned int	place_steppers; /* how many of them are stepping's */
+	unsigned int	place_gen;
+	clamma_atomic_t	place_next; /* stepping cpu for the next thread */
+} clamma_pool_t;
+
+extern unsigned int thread_init_refcount;
+extern unsigned int numa_nodes; /* 0 or 1 means no NUMA handling */
+extern uint64_t smp_spin_ns;
+extern int numa_node_id[CLAMMA_NUMA_MAX];
 extern clamma_mutex_t          mut_sessions;
+extern clamma_sem_t            sem_sessions;
 
 void
 clamma_smp_deinit(void);
 
 int
-clamma_smp_init(unsigned int threads);
+clamma_smp_init(void);
+
+clamma_pool_t *
+clamma_pool_create(unsigned int threads);
+
+void
+clamma_pool_destroy(clamma_pool_t *pool);
+
+int
+clamma_txf_pool_attach(struct txf *t, clamma_pool_t *pool);
+
+clamma_pool_t *
+clamma_txf_pool(const struct txf *t);
 
 int
 session_matmul(txf_session_state_t *tss, float *xout, const float *x,
@@ -306,11 +893,46 @@ int
 session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x, const qt_t *w,
 		int n, int d);
 
+int
+session_vocab_batch(txf_session_state_t *tss, clamma_job_type_t type,
+		    vocab_batch_t *vb, size_t count);
+
+int
+session_prefault(txf_session_state_t *tss, const uint8_t *p, size_t len);
+
+int
+session_graph(txf_session_state_t *tss);
+
+int
+clamma_smp_ops_waiting(const txf_session_state_t *tss, unsigned long k);
+
+const void *
+clamma_numa_local(int node, const struct txf *t, const void *p);
+
 void
 clamma_smp_sync_point(txf_session_state_t *tss);
 
+void
+clamma_smp_spin(uint64_t ns);
+
+int
+clamma_smp_affinity(clamma_affinity_t policy, const char *cpus);
+
 int
-clamma_smp_tss_init(txf_session_state_t *tss);
+clamma_smp_steppers(unsigned int n);
+
+void
+clamma_smp_place_caller(clamma_pool_t *pool);
+
+void
+clamma_smp_describe(const clamma_pool_t *pool, char *buf, size_t len);
+
+int
+clamma_smp_worker_stats(const clamma_pool_t *pool, unsigned int n,
+			uint64_t *busy_ns, uint64_t *chunks, uint64_t *steals);
+
+int
+clamma_smp_tss_init(txf_session_state_t *tss, clamma_pool_t *pool);
 
 void
 clamma_smp_tss_deinit(txf_session_state_t *tss);
@@ -318,6 +940,19 @@ clamma_smp_tss_deinit(txf_session_state_t *tss);
 void *
 clamma_session_worker(void *tp);
 
+void *
+clamma_weight_prefetch_worker(void *tp);
+
+int
+clamma_smp_thread_create(pthread_t *pt, void *(*fn)(void *), void *arg);
+
+void
+clamma_smp_thread_join(pthread_t pt);
+
+/* 0 if the mutex was taken without waiting */
+int
+clamma_smp_mutex_trylock(clamma_mutex_t *m);
+
 #else
 static inline int
 session_matmul(txf_session_state_t *tss, float *xout, const float *x, const float *w1,
@@ -333,6 +968,33 @@ session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x, const qt
 	return _session_matmul_qt(tss, xout, x, w, 0, d, n, d);
 }
 
+static inline int
+session_graph(txf_session_state_t *tss)
+{
+	clamma_graph_run((txf_state_t *)((char *)tss -
+					 offsetof(txf_state_t, tss)), -1, 0);
+
+	return 0;
+}
+
+static inline int
+clamma_smp_ops_waiting(const txf_session_state_t *tss, unsigned long k)
+{
+	(void)tss;
+	(void)k;
+
+	return 0;
+}
+
+static inline const void *
+clamma_numa_local(int node, const struct txf *t, const void *p)
+{
+	(void)node;
+	(void)t;
+
+	return p;
+}
+
 static inline void
 clamma_smp_sync_point(txf_session_state_t *tss)
 {
@@ -340,14 +1002,46 @@ clamma_smp_sync_point(txf_session_state_t *tss)
 	do { } while(0);
 }
 
+typedef struct clamma_pool clamma_pool_t;
+
 static inline int
-clamma_smp_init(unsigned int threads)
+clamma_smp_init(void)
 {
-	(void)threads;
 	do { } while(0);
 	return 0;
 }
 
+static inline clamma_pool_t *
+clamma_pool_create(unsigned int threads)
+{
+	(void)threads;
+
+	return NULL;
+}
+
+static inline void
+clamma_pool_destroy(clamma_pool_t *pool)
+{
+	(void)pool;
+}
+
+static inline int
+clamma_txf_pool_attach(struct txf *t, clamma_pool_t *pool)
+{
+	(void)t;
+	(void)pool;
+
+	return 1;
+}
+
+static inline clamma_pool_t *
+clamma_txf_pool(const struct txf *t)
+{
+	(void)t;
+
+	return NULL;
+}
+
 static inline void
 clamma_smp_deinit(void)
 {
@@ -355,9 +1049,10 @@ clamma_smp_deinit(void)
 }
 
 static inline int
-clamma_smp_tss_init(txf_session_state_t *tss)
+clamma_smp_tss_init(txf_session_state_t *tss, clamma_pool_t *pool)
 {
 	(void)tss;
+	(void)pool;
 	do { } while(0);
 	return 0;
 }
@@ -368,6 +1063,53 @@ clamma_smp_tss_deinit(txf_session_state_t *tss)
 	(void)tss;
 	do { } while(0);
 }
+
+static inline void
+clamma_smp_spin(uint64_t ns)
+{
+	(void)ns;
+}
+
+static inline int
+clamma_smp_affinity(clamma_affinity_t policy, const char *cpus)
+{
+	(void)cpus;
+
+	return policy != CLAMMA_AFFINITY_NONE;
+}
+
+static inline int
+clamma_smp_steppers(unsigned int n)
+{
+	return n != 1;
+}
+
+static inline void
+clamma_smp_place_caller(clamma_pool_t *pool)
+{
+	(void)pool;
+}
+
+static inline void
+clamma_smp_describe(const clamma_pool_t *pool, char *buf, size_t len)
+{
+	(void)pool;
+	if (len)
+		buf[0] = '\0';
+}
+
+static inline int
+clamma_smp_worker_stats(const clamma_pool_t *pool, unsigned int n,
+			uint64_t *busy_ns, uint64_t *chunks, uint64_t *steals)
+{
+	(void)pool;
+	(void)n;
+	(void)busy_ns;
+	(void)chunks;
+	(void)steals;
+
+	return 1;
+}
 #endif
 
 void
@@ -377,7 +1119,83 @@ const void *
 clamma_weight_cache(const txf_t *t, const void *weight, size_t size);
 
 void
-clamma_weight_cache_clear(void);
+clamma_weight_cache_release(const txf_t *t, const void *cached);
+
+void
+clamma_weight_cache_prefetch(const txf_t *t, unsigned int l);
+
+void
+clamma_weight_cache_prefetch_cancel(const txf_t *t);
+
+int
+clamma_txf_weight_stream(txf_t *t, int enable);
+
+int
+clamma_weight_stream_pass_begin(const txf_t *t);
+
+void
+clamma_weight_stream_pass_end(const txf_t *t, int locked);
+
+int
+clamma_txf_direct_io(txf_t *t, int enable);
+
+void
+clamma_mmap_willneed(const txf_t *t, unsigned int l);
+
+void *
+clamma_huge_map(size_t len);
+
+void
+clamma_huge_unmap(void *p, size_t len);
+
+int
+clamma_txf_hugepages(txf_t *t, int hugetlb);
+
+void
+clamma_prefault_run(const uint8_t *p, size_t len);
+
+int
+clamma_txf_prefault(txf_t *t, int lock);
+
+int
+clamma_txf_numa_replicate(txf_t *t);
+
+int
+clamma_model_read(const txf_t *t, void *dst, size_t len, size_t need,
+		  uint64_t ofs);
+
+int
+clamma_txf_shared_publish(const txf_t *t, const char *name);
+
+int
+clamma_txf_shared_attach(txf_t *t, const char *name);
+
+int
+clamma_weight_cache_init(txf_t *t);
+
+void
+clamma_weight_cache_deinit(txf_t *t);
+
+void
+clamma_weight_cache_clear(const txf_t *t);
+
+void
+clamma_weight_cache_budget(size_t bytes);
+
+int
+clamma_weight_cache_index(txf_t *t);
+
+int
+clamma_weight_cache_stats(const txf_t *t, clamma_wc_stats_t *st);
+
+const char *
+clamma_weight_class_name(clamma_wclass_t cls);
+
+int
+clamma_weight_cache_limit(txf_t *t, size_t limit);
+
+int
+clamma_weight_cache_pin_layer(txf_t *t, unsigned int l, int pin);
 
 int
 clamma_sampler_sample(txf_sampler_t *sampler, float *logits);
@@ -395,12 +1213,76 @@ tok_id_t *
 clamma_vocab_encode(const struct txf *t, const char *text, int8_t bos, int8_t eos,
 		    size_t *n_tokens);
 
+tok_id_t *
+clamma_vocab_encode_segments(const struct txf *t, const vseg_t *segs,
+			     size_t count, int8_t bos, int8_t eos,
+			     size_t *n_tokens);
+
+void
+clamma_txf_prompt_cache_stats(const struct txf *t, uint64_t *hits,
+			      uint64_t *misses, unsigned int *entries);
+
+void
+clamma_txf_prompt_cache_limit(const struct txf *t, unsigned int entries);
+
 const char *
 clamma_vocab_decode(const struct txf *t, int prev_token, int token);
 
+const char *
+clamma_vocab_decode_r(const struct txf *t, char *utf8, int prev_token,
+		      int token);
+
+int
+clamma_vocab_batch_run(vocab_batch_t *vb, clamma_job_type_t type,
+		       size_t from, size_t to, char **scratch,
+		       size_t *scratch_len);
+
+txf_vocab_t *
+clamma_vocab_load(const char *tokenizer_path, size_t vocab_size,
+		  unsigned int threads);
+
+void
+clamma_vocab_unload(txf_vocab_t *v);
+
+size_t
+clamma_vocab_encode_batch_bound(const char * const *texts, size_t count);
+
+int
+clamma_vocab_encode_batch(const txf_vocab_t *v, const char * const *texts,
+			  size_t count, int8_t bos, int8_t eos,
+			  tok_id_t *tokens, size_t max_tokens, size_t *offsets);
+
+size_t
+clamma_vocab_decode_batch_bound(const txf_vocab_t *v, const size_t *offsets,
+				size_t count);
+
+int
+clamma_vocab_decode_batch(const txf_vocab_t *v, const tok_id_t *tokens,
+			  const size_t *offsets, size_t count, char *text,
+			  size_t max_text, size_t *text_offsets);
+
 tok_id_t
 clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos);
 
+void
+clamma_session_persist(txf_session_t *ts, int persist);
+
+int
+clamma_session_append(txf_session_t *ts, const clamma_txf_info_t *info);
+
+size_t
+clamma_txf_session_footprint(const struct txf *t, size_t positions);
+
+int
+clamma_txf_session_budget(struct txf *t, size_t bytes);
+
+txf_session_t *
+clamma_session_construct_admit(const struct txf *t, size_t positions,
+			       clamma_admit_t *reason);
+
+const char *
+clamma_admit_reason_name(clamma_admit_t r);
+
 uint64_t
 clamma_timestamp_ns(void);
 
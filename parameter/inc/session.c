@@ -78,6 +78,8 @@ session_rmsnorm(const txf_t *t, float *o, const float *x, const float *weight,
 	for (j = 0; j < size; j++)
 		o[j] = w[j] * (ss * x[j]);
 
+	clamma_weight_cache_release(t, w);
+
 	return 0;
 }
 
@@ -85,7 +87,8 @@ int
 _session_matmul(txf_session_state_t *tss, float *xout, const float *x, const float *w1,
 		int i, int dlim, int n, int d)
 {
-	const float *w = clamma_weight_cache(tss->t, w1, n * d * sizeof(float));
+	const float *wc = clamma_weight_cache(tss->t, w1, n * d * sizeof(float)),
+		    *w = wc;
 
 	if (!w)
 		return 1;
@@ -103,6 +106,8 @@ _session_matmul(txf_session_state_t *tss, float *xout, const float *x, const flo
 		*xout++ = f;
 	}
 
+	clamma_weight_cache_release(tss->t, wc);
+
 	return 0;
 }
 
@@ -111,13 +116,16 @@ _session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
 		   const qt_t *w1, int i, int dlim, int n, int d)
 {
 	const cq_t *w_q = clamma_weight_cache(tss->t, w1->q,
-				(d * n) + (tss->t->c.group_size * n));
+					     qt_q_len(tss->t, n, d));
 	const float *w_s = clamma_weight_cache(tss->t, w1->s,
-				((d * n) / tss->t->c.group_size) * sizeof(*w_s));
+					       qt_s_len(tss->t, n, d));
 	long ln = (long)n;
 
-	if (!w_q || !w_s)
+	if (!w_q || !w_s) {
+		clamma_weight_cache_release(tss->t, w_q);
+		clamma_weight_cache_release(tss->t, w_s);
 		return 1;
+	}
 
 	for (; i < dlim; i++) {
 
@@ -139,6 +147,9 @@ _session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
 		xout[i] = val;
 	}
 
+	clamma_weight_cache_release(tss->t, w_q);
+	clamma_weight_cache_release(tss->t, w_s);
+
 	return 0;
 }
 
@@ -165,105 +176,428 @@ session_softmax(float *x, int size)
 		x[i] /= sum;
 }
 
-tok_id_t
-clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
+static unsigned int
+add_wref(clamma_wref_t *w, unsigned int c, const void *p, size_t len,
+	 clamma_wclass_t cls)
 {
-	const txf_t *t = ts->t;
-	uint32_t kv_dim = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
-		 kv_mul = t->c.n_heads / t->c.n_kv_heads,
-		 head_size = t->c.dim / t->c.n_heads;
-	float *content_row = t->w.token_embedding_table + (token * t->c.dim),
-	      *key_cache_row, *value_cache_row;
-	const float *f = content_row;
-	txf_session_state_t *tss = &ts->s.tss;
+	w[c].p = p;
+	w[c].len = len;
+	w[c].cls = (uint8_t)cls;
+
+	return c + 1;
+}
 
+static unsigned int
+add_wref_mm(const txf_t *t, clamma_wref_t *w, unsigned int c, const void *fw,
+	    const qt_t *qw, int n, int d, clamma_wclass_t cls)
+{
 	switch (t->c.version) {
 	case CLAMMA_MODEL_VERSION1_FLOAT:
-		f = clamma_weight_cache(t, content_row,
-					t->c.dim * sizeof(*ts->s.x));
-		if (!f)
-			goto bail;
-		break;
+		return add_wref(w, c, fw, (size_t)n * d * sizeof(float), cls);
 	}
 
-	/*
-	 * Copy the initial token embedding into ts->s.x, this is updated twice
-	 * per layer with "residuals"
-	 */
+	c = add_wref(w, c, qw->q, qt_q_len(t, n, d), cls);
 
-	memcpy(ts->s.x, f, t->c.dim * sizeof(*ts->s.x));
+	return add_wref(w, c, qw->s, qt_s_len(t, n, d), cls);
+}
 
-	/* for each layer... */
+/*
+ * Lists the weights clamma_session_forward() will fetch for layer l, with
+ * the same extents it will fetch them with
+ */
 
-	for (uint64_t l = 0; l < t->c.n_layers; l++) {
-		int loff = l * t->c.seq_len * kv_dim;
+unsigned int
+clamma_layer_weights(const txf_t *t, unsigned int l, clamma_wref_t *w)
+{
+	uint32_t kv_dim = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
+	size_t dd = (size_t)l * t->c.dim * t->c.dim,
+	       dk = (size_t)l * t->c.dim * kv_dim,
+	       dh = (size_t)l * t->c.dim * t->c.hidden_dim;
+	unsigned int c = 0;
 
-		// uint64_t start = clamma_timestamp_ns();
+	if (l > t->c.n_layers)
+		return 0;
 
-		/*
-		 * this section parallelizeable ------>
-		 */
+	if (l == t->c.n_layers) {
+		c = add_wref(w, c, t->w.rms_final_weight,
+			     t->c.dim * sizeof(float), CLAMMA_WCLASS_RMS);
 
-		/* key and value point to the kv cache */
+		return add_wref_mm(t, w, c, t->w.wcls, t->w.wcls,
+				   t->c.dim, t->c.vocab_size, CLAMMA_WCLASS_CLS);
+	}
 
-		tss->k = ts->s.key_cache   + loff + pos * kv_dim;
-		tss->v = ts->s.value_cache + loff + pos * kv_dim;
+	c = add_wref(w, c, t->w.rms_att_weight + l * t->c.dim,
+		     t->c.dim * sizeof(float), CLAMMA_WCLASS_RMS);
+	c = add_wref_mm(t, w, c, (txi_t *)t->w.wq + dd, t->w.wq + l,
+			t->c.dim, t->c.dim, CLAMMA_WCLASS_WQ);
+	c = add_wref_mm(t, w, c, (txi_t *)t->w.wk + dk, t->w.wk + l,
+			t->c.dim, kv_dim, CLAMMA_WCLASS_WK);
+	c = add_wref_mm(t, w, c, (txi_t *)t->w.wv + dk, t->w.wv + l,
+			t->c.dim, kv_dim, CLAMMA_WCLASS_WV);
+	c = add_wref_mm(t, w, c, (txi_t *)t->w.wo + dd, t->w.wo + l,
+			t->c.dim, t->c.dim, CLAMMA_WCLASS_WO);
+	c = add_wref(w, c, t->w.rms_ffn_weight + l * t->c.dim,
+		     t->c.dim * sizeof(float), CLAMMA_WCLASS_RMS);
+	c = add_wref_mm(t, w, c, (txi_t *)t->w.w1 + dh, t->w.w1 + l,
+			t->c.dim, t->c.hidden_dim, CLAMMA_WCLASS_W1);
+	c = add_wref_mm(t, w, c, (txi_t *)t->w.w3 + dh, t->w.w3 + l,
+			t->c.dim, t->c.hidden_dim, CLAMMA_WCLASS_W3);
+
+	return add_wref_mm(t, w, c, (txi_t *)t->w.w2 + dh, t->w.w2 + l,
+			   t->c.hidden_dim, t->c.dim, CLAMMA_WCLASS_W2);
+}
 
-		/*
-		 * xb <- resnorm (x, rms_att_weight)
-		 *   q  <- matmul(xb, q weights)
-		 *   k  <- matmul(xb, v weights)
-		 *   v  <- matmul(xb, v weights)
-		 */
+/*
+ * Building the layer graph: nodes and their dependencies are collected first,
+ * then the dependencies are turned around into each node's successors
+ */
 
-		switch (t->c.version) {
-		case CLAMMA_MODEL_VERSION1_FLOAT:
-			/* attention session_rmsnorm */
-			if (session_rmsnorm(t, tss->xb, ts->s.x,
-					 t->w.rms_att_weight +
-					 l * t->c.dim, t->c.dim))
-				goto bail;
-
-			/* qkv session_matmuls for this position */
-			if (session_matmul(tss, tss->q, tss->xb,
-				    (txi_t *)t->w.wq + l * t->c.dim * t->c.dim,
-				    t->c.dim, t->c.dim) ||
-			    session_matmul(tss, tss->k, tss->xb,
-				    (txi_t *)t->w.wk + l * t->c.dim * kv_dim,
-				    t->c.dim, kv_dim) ||
-			    session_matmul(tss, tss->v, tss->xb,
-				    (txi_t *)t->w.wv + l * t->c.dim * kv_dim,
-				    t->c.dim, kv_dim))
-				goto bail;
-			break;
-		case CLAMMA_MODEL_VERSION2_INT8_80:
-			if (session_rmsnorm(t, tss->xb, ts->s.x,
-					 t->w.rms_att_weight +
-					 l * t->c.dim, t->c.dim))
-				goto bail;
+typedef struct {
+	clamma_gnode_t	*node;
+	uint32_t	(*edge)[2]; /* edge[0] waits on edge[1] */
+	unsigned int	nn, an, ne, ae;
+	char		oom;
+} gbuild_t;
 
-			quantize(t, &tss->xq, tss->xb, t->c.dim);
+static uint32_t
+gb_node(gbuild_t *b, clamma_gop_t op, clamma_gmat_t m, uint32_t a, uint32_t e)
+{
+	clamma_gnode_t *gn;
+
+	if (b->nn == b->an) {
+		unsigned int an = b->an ? b->an * 2 : 256;
+
+		gn = realloc(b->node, an * sizeof(*gn));
+		if (!gn) {
+			b->oom = 1;
+			return 0;
+		}
+		b->node = gn;
+		b->an = an;
+	}
+
+	gn = &b->node[b->nn];
+	memset(gn, 0, sizeof(*gn));
+	gn->op	= (uint8_t)op;
+	gn->m	= (uint8_t)m;
+	gn->a	= a;
+	gn->b	= e;
+
+	return b->nn++;
+}
+
+static void
+gb_dep(gbuild_t *b, uint32_t n, uint32_t on)
+{
+	if (b->ne == b->ae) {
+		unsigned int ae = b->ae ? b->ae * 2 : 1024;
+		uint32_t (*e)[2] = realloc(b->edge, ae * sizeof(*e));
+
+		if (!e) {
+			b->oom = 1;
+			return;
+		}
+		b->edge = e;
+		b->ae = ae;
+	}
+
+	b->edge[b->ne][0] = n;
+	b->edge[b->ne++][1] = on;
+}
+
+/* the tiles of an output of d rows, all waiting on node on */
+
+static uint32_t
+gb_tiles(gbuild_t *b, clamma_gmat_t m, uint32_t d, uint32_t on)
+{
+	uint32_t first = b->nn, r, e;
+
+	for (r = 0; r < d; r += CLAMMA_GRAPH_TILE_ROWS) {
+		e = r + CLAMMA_GRAPH_TILE_ROWS;
+		gb_dep(b, gb_node(b, CLAMMA_GOP_MATMUL, m, r, e > d ? d : e),
+		       on);
+	}
+
+	return first;
+}
+
+/* node n waits on the tiles from first that write rows lo .. hi */
+
+static void
+gb_dep_rows(gbuild_t *b, uint32_t n, uint32_t first, uint32_t lo, uint32_t hi)
+{
+	uint32_t i;
+
+	for (i = lo / CLAMMA_GRAPH_TILE_ROWS;
+	     i <= (hi - 1) / CLAMMA_GRAPH_TILE_ROWS; i++)
+		gb_dep(b, n, first + i);
+}
+
+/* node n waits on all the tiles from first that write d rows */
+
+static void
+gb_dep_tiles(gbuild_t *b, uint32_t n, uint32_t first, uint32_t d)
+{
+	gb_dep_rows(b, n, first, 0, d);
+}
+
+int
+clamma_graph_build(txf_t *t)
+{
+	uint32_t kv_dim = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
+		 kv_mul = t->c.n_heads / t->c.n_kv_heads,
+		 hs = t->c.dim / t->c.n_heads, hidden = t->c.hidden_dim,
+		 in, q, k, v, o, w1, w3, w2, rope, attn, j, r, h, i, kh;
+	int qt = t->c.version == CLAMMA_MODEL_VERSION2_INT8_80;
+	clamma_graph_t *g = &t->graph;
+	gbuild_t b;
+
+	memset(&b, 0, sizeof(b));
+
+	/* attention: xb <- rmsnorm(x), then q, k and v from it */
+
+	in = gb_node(&b, CLAMMA_GOP_RMSNORM, 0, 0, 0);
+	if (qt) {
+		j = gb_node(&b, CLAMMA_GOP_QUANTIZE, 0, 0, 0);
+		gb_dep(&b, j, in);
+		in = j;
+	}
+	q = gb_tiles(&b, CLAMMA_GMAT_WQ, t->c.dim, in);
+	k = gb_tiles(&b, CLAMMA_GMAT_WK, kv_dim, in);
+	v = gb_tiles(&b, CLAMMA_GMAT_WV, kv_dim, in);
+
+	/* each head can be rotated once its rows of q, and k, are in */
+
+	rope = b.nn;
+	for (h = 0; h < t->c.n_heads; h++) {
+		r = gb_node(&b, CLAMMA_GOP_ROPE, 0, h, 0);
+		gb_dep_rows(&b, r, q, h * hs, (h + 1) * hs);
+		if (h * hs < kv_dim)
+			gb_dep_rows(&b, r, k, h * hs, (h + 1) * hs);
+	}
+
+	/* ... and attend once its kv head is rotated and its v rows are in */
+
+	attn = b.nn;
+	for (h = 0; h < t->c.n_heads; h++) {
+		kh = h / kv_mul;
+		r = gb_node(&b, CLAMMA_GOP_ATTN, 0, h, 0);
+		gb_dep(&b, r, rope + h);
+		if (kh != h)
+			gb_dep(&b, r, rope + kh);
+		gb_dep_rows(&b, r, v, kh * hs, (kh + 1) * hs);
+	}
+
+	/* the output projection needs every head, into xb then x += xb */
+
+	j = gb_node(&b, qt ? CLAMMA_GOP_QUANTIZE : CLAMMA_GOP_JOIN, 0,
+		    1, 0);
+	for (h = 0; h < t->c.n_heads; h++)
+		gb_dep(&b, j, attn + h);
+	o = gb_tiles(&b, CLAMMA_GMAT_WO, t->c.dim, j);
+	r = gb_node(&b, CLAMMA_GOP_RESIDUAL, 0, 0, 0);
+	gb_dep_tiles(&b, r, o, t->c.dim);
+
+	/* ffn: xb <- rmsnorm(x), then hb and hb2 from it */
+
+	in = gb_node(&b, CLAMMA_GOP_RMSNORM, 0, 1, 0);
+	gb_dep(&b, in, r);
+	if (qt) {
+		j = gb_node(&b, CLAMMA_GOP_QUANTIZE, 0, 0, 0);
+		gb_dep(&b, j, in);
+		in = j;
+	}
+	w1 = gb_tiles(&b, CLAMMA_GMAT_W1, hidden, in);
+	w3 = gb_tiles(&b, CLAMMA_GMAT_W3, hidden, in);
+
+	/* SwiGLU goes tile by tile, as each pair of hb and hb2 tiles is in */
+
+	j = gb_node(&b, qt ? CLAMMA_GOP_QUANTIZE : CLAMMA_GOP_JOIN, 0,
+		    2, 0);
+	for (i = 0; i * CLAMMA_GRAPH_TILE_ROWS < hidden; i++) {
+		r = gb_node(&b, CLAMMA_GOP_SWIGLU, 0,
+			    i * CLAMMA_GRAPH_TILE_ROWS,
+			    (i + 1) * CLAMMA_GRAPH_TILE_ROWS > hidden ? hidden :
+				    (i + 1) * CLAMMA_GRAPH_TILE_ROWS);
+		gb_dep(&b, r, w1 + i);
+		gb_dep(&b, r, w3 + i);
+		gb_dep(&b, j, r);
+	}
+
+	/* xb <- w2 over all of hb, then x += xb */
+
+	w2 = gb_tiles(&b, CLAMMA_GMAT_W2, t->c.dim, j);
+	r = gb_node(&b, CLAMMA_GOP_RESIDUAL, 0, 0, 0);
+	gb_dep_tiles(&b, r, w2, t->c.dim);
+
+	if (b.oom)
+		goto bail;
+
+	/* turn the deps around into successor lists */
+
+	g->succ = malloc((b.ne ? b.ne : 1) * sizeof(*g->succ));
+	if (!g->succ)
+		goto bail;
+
+	for (i = 0; i < b.ne; i++) {
+		b.node[b.edge[i][0]].ndeps++;
+		b.node[b.edge[i][1]].nsucc++;
+	}
+	for (i = 0, j = 0; i < b.nn; i++) {
+		b.node[i].succ = j;
+		j += b.node[i].nsucc;
+		b.node[i].nsucc = 0;
+	}
+	for (i = 0; i < b.ne; i++) {
+		clamma_gnode_t *gn = &b.node[b.edge[i][1]];
+
+		g->succ[gn->succ + gn->nsucc++] = b.edge[i][0];
+	}
+
+	free(b.edge);
+	g->node = b.node;
+	g->nnodes = b.nn;
+
+	return 0;
+
+bail:
+	fprintf(stderr, "%s: OOM\n", __func__);
+	free(b.edge);
+	free(b.node);
+
+	return 1;
+}
+
+void
+clamma_graph_destroy(txf_t *t)
+{
+	free(t->graph.node);
+	free(t->graph.succ);
+	memset(&t->graph, 0, sizeof(t->graph));
+}
+
+static int
+graph_matmul(txf_state_t *s, const clamma_gnode_t *gn, int node)
+{
+	txf_session_state_t *tss = &s->tss;
+	const txf_t *t = tss->t;
+	size_t kv_dim = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
+	       l = s->g.layer,
+	       row = (l * t->c.seq_len + (size_t)s->g.pos) * kv_dim,
+	       dd = l * t->c.dim * t->c.dim, dk = l * t->c.dim * kv_dim,
+	       dh = l * t->c.dim * t->c.hidden_dim;
+	const qt_t *qx = &tss->xq, *qw;
+	const float *x = tss->xb;
+	const void *fw;
+	int n = (int)t->c.dim, d;
+	float *out;
+	qt_t lq;
+
+	switch (gn->m) {
+	case CLAMMA_GMAT_WQ:
+		out	= tss->q;
+		d	= (int)t->c.dim;
+		fw	= (txi_t *)t->w.wq + dd;
+		qw	= t->w.wq + l;
+		break;
+	case CLAMMA_GMAT_WK: /* straight into the kv cache */
+		out	= s->key_cache + row;
+		d	= (int)kv_dim;
+		fw	= (txi_t *)t->w.wk + dk;
+		qw	= t->w.wk + l;
+		break;
+	case CLAMMA_GMAT_WV:
+		out	= s->value_cache + row;
+		d	= (int)kv_dim;
+		fw	= (txi_t *)t->w.wv + dk;
+		qw	= t->w.wv + l;
+		break;
+	case CLAMMA_GMAT_WO:
+		out	= tss->xb;
+		x	= tss->xb2;
+		d	= (int)t->c.dim;
+		fw	= (txi_t *)t->w.wo + dd;
+		qw	= t->w.wo + l;
+		break;
+	case CLAMMA_GMAT_W1:
+		out	= tss->hb;
+		d	= (int)t->c.hidden_dim;
+		fw	= (txi_t *)t->w.w1 + dh;
+		qw	= t->w.w1 + l;
+		break;
+	case CLAMMA_GMAT_W3:
+		out	= tss->hb2;
+		d	= (int)t->c.hidden_dim;
+		fw	= (txi_t *)t->w.w3 + dh;
+		qw	= t->w.w3 + l;
+		break;
+	default: /* CLAMMA_GMAT_W2 */
+		out	= tss->xb;
+		x	= tss->hb;
+		qx	= &tss->hq;
+		n	= (int)t->c.hidden_dim;
+		d	= (int)t->c.dim;
+		fw	= (txi_t *)t->w.w2 + dh;
+		qw	= t->w.w2 + l;
+		break;
+	}
+
+	switch (t->c.version) {
+	case CLAMMA_MODEL_VERSION1_FLOAT:
+		return _session_matmul(tss, out, x,
+				       clamma_numa_local(node, t, fw),
+				       (int)gn->a, (int)gn->b, n, d);
+	}
 
-			/* qkv session_matmuls for this position */
-			if (session_matmul_qt(tss, tss->q, &tss->xq, t->w.wq + l,
-					   t->c.dim, t->c.dim) ||
-			    session_matmul_qt(tss, tss->k, &tss->xq, t->w.wk + l,
-					   t->c.dim, kv_dim) ||
-			    session_matmul_qt(tss, tss->v, &tss->xq, t->w.wv + l,
-					   t->c.dim, kv_dim))
-				goto bail;
+	lq.q = (cq_t *)clamma_numa_local(node, t, qw->q);
+	lq.s = (float *)clamma_numa_local(node, t, qw->s);
+
+	return _session_matmul_qt(tss, out, qx, &lq, (int)gn->a, (int)gn->b,
+				  n, d);
+}
+
+static int
+graph_op(txf_state_t *s, const clamma_gnode_t *gn, int node)
+{
+	txf_session_state_t *tss = &s->tss;
+	const txf_t *t = tss->t;
+	uint32_t kv_dim = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
+		 kv_mul = t->c.n_heads / t->c.n_kv_heads,
+		 head_size = t->c.dim / t->c.n_heads, i;
+	size_t loff = (size_t)s->g.layer * t->c.seq_len * kv_dim;
+	int pos = s->g.pos;
+
+	switch (gn->op) {
+	case CLAMMA_GOP_RMSNORM:
+		return session_rmsnorm(t, tss->xb, s->x,
+				       (gn->a ? t->w.rms_ffn_weight :
+						t->w.rms_att_weight) +
+				       s->g.layer * t->c.dim, t->c.dim);
+
+	case CLAMMA_GOP_QUANTIZE:
+		switch (gn->a) {
+		case 0:
+			quantize(t, &tss->xq, tss->xb, t->c.dim);
+			break;
+		case 1:
+			quantize(t, &tss->xq, tss->xb2, t->c.dim);
+			break;
+		default:
+			quantize(t, &tss->hq, tss->hb, t->c.hidden_dim);
 			break;
 		}
-		clamma_smp_sync_point(tss);
+		break;
+
+	case CLAMMA_GOP_MATMUL:
+		return graph_matmul(s, gn, node);
 
+	case CLAMMA_GOP_ROPE:
 		/*
 		 * RoPE relative positional encoding:
-		 *    complex-valued rotate q and optionally k in each head
-		 *
-		 *     tss->q <-- selfmunge
-		 *     tss->k <-- selfmunge
+		 *    complex-valued rotate q and optionally k in the head
 		 */
-		for (uint32_t i = 0; i < t->c.dim; i += 2) {
+		for (i = gn->a * head_size; i < (gn->a + 1) * head_size;
+								i += 2) {
 			uint32_t head_dim = i % head_size,
 				 do_k = i < kv_dim ? 2 : 1;
 			float freq = 1.0f / powf(10000.0f,
@@ -271,198 +605,226 @@ clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
 			      val = pos * freq, fcr = cosf(val), fci = sinf(val);
 
 			for (uint32_t v = 0; v < do_k; v++) {
-				float *vec = v == 0 ? tss->q : tss->k,
+				float *vec = v == 0 ? tss->q : s->key_cache +
+						loff + (size_t)pos * kv_dim,
 					v0 = vec[i], v1 = vec[i + 1];
 
 				vec[i]     = v0 * fcr - v1 * fci;
 				vec[i + 1] = v0 * fci + v1 * fcr;
 			}
 		}
+		break;
+
+	case CLAMMA_GOP_ATTN: {
+		/* get the query vector for this head */
+		float *q = tss->q + gn->a * head_size, *xb,
+		      *att = tss->att + gn->a * t->c.seq_len;
+		size_t ko = loff + (gn->a / kv_mul) * head_size;
 
-		key_cache_row = ts->s.key_cache + loff + pos * kv_dim;
-		value_cache_row = ts->s.value_cache + loff + pos * kv_dim;
-		memcpy(key_cache_row, tss->k, kv_dim *
-					sizeof(*key_cache_row));
-		memcpy(value_cache_row, tss->v, kv_dim *
-					sizeof(*value_cache_row));
-
-		/* multihead attention. iterate over all heads
-		 *
-		 *   tss->att <-- tss->s.q, tss->s.key_cache
-		 *   tss->xb  <-- zeroed
-		 *            <-- value_cache, att
+		/* iterate over all timesteps, including the current one */
+		for (int n = 0; n <= pos; n++) {
+			/*
+			 * get the key vector for this head
+			 * and at this timestep
+			 */
+			float *k = s->key_cache + ko + n * kv_dim,
+				score = 0.0f;
+
+			for (i = 0; i < head_size; i++)
+				score += q[i] * k[i];
+
+			score /= sqrtf(head_size);
+			att[n] = score;
+		}
+
+		/*
+		 * softmax the scores to get attention weights,
+		 * from 0..pos inclusively
 		 */
+		session_softmax(att, pos + 1);
 
-		for (uint32_t h = 0; h < t->c.n_heads; h++) {
-			/* get the query vector for this head */
-			float *q = tss->q + h * head_size, *xb,
-			      *att = tss->att + h * t->c.seq_len;
-
-			/* iterate over all timesteps, including the current one */
-			for (int n = 0; n <= pos; n++) {
-				/*
-				 * get the key vector for this head
-				 * and at this timestep
-				 */
-				float *k = ts->s.key_cache + loff + n * kv_dim +
-						(h / kv_mul) * head_size,
-					score = 0.0f;
-
-				for (uint32_t i = 0; i < head_size; i++)
-					score += q[i] * k[i];
-
-				score /= sqrtf(head_size);
-				att[n] = score;
-			}
+		/* weighted sum of the values, store into xb2 */
+		xb = tss->xb2 + gn->a * head_size;
+
+		memset(xb, 0, head_size * sizeof(float));
+
+		for (int n = 0; n <= pos; n++) {
+			float *v = s->value_cache + ko + n * kv_dim, a = att[n];
+
+			for (i = 0; i < head_size; i++)
+				xb[i] += a * v[i];
+		}
+		break;
+	}
 
+	case CLAMMA_GOP_SWIGLU:
+		for (i = gn->a; i < gn->b; i++)
 			/*
-			 * softmax the scores to get attention weights,
-			 * from 0..pos inclusively
+			 * silu(x)=x*σ(x), where σ(x) is the logistic sigmoid
+			 * elementwise multiply with w3(x)
 			 */
-			session_softmax(att, pos + 1);
+			tss->hb[i] = (tss->hb[i] * (1.0f /
+				     (1.0f + expf(-tss->hb[i])))) * tss->hb2[i];
+		break;
 
-			/* weighted sum of the values, store back into xb */
-			xb = tss->xb + h * head_size;
+	case CLAMMA_GOP_RESIDUAL:
+		/* residual connection goes back into x */
+		for (i = 0; i < t->c.dim; i++)
+			s->x[i] += tss->xb[i];
+		break;
+	}
 
-			memset(xb, 0, head_size * sizeof(float));
+	return 0;
+}
 
-			for (int n = 0; n <= pos; n++) {
-				float *v = ts->s.value_cache + loff +
-						n * kv_dim +
-						(h / kv_mul) * head_size,
-					a = att[n];
+static void
+graph_push(clamma_graph_run_t *r, uint32_t n)
+{
+	long slot = clamma_atomic_add(&r->tail, 1);
 
-				for (uint32_t i = 0; i < head_size; i++)
-					xb[i] += a * v[i];
+	clamma_atomic_store(&r->ready[slot], (long)n + 1);
+}
+
+/* set up s to run the graph for layer l at pos, with the roots ready */
+
+static void
+graph_start(txf_state_t *s, unsigned int l, int pos)
+{
+	const clamma_graph_t *g = &s->tss.t->graph;
+	clamma_graph_run_t *r = &s->g;
+	unsigned int n;
+
+	r->layer	= l;
+	r->pos		= pos;
+	clamma_atomic_store(&r->head, 0);
+	clamma_atomic_store(&r->tail, 0);
+	clamma_atomic_store(&r->done, 0);
+	clamma_atomic_store(&r->failed, 0);
+
+	for (n = 0; n < g->nnodes; n++) {
+		clamma_atomic_store(&r->ready[n], 0);
+		clamma_atomic_store(&r->pending[n], (long)g->node[n].ndeps);
+	}
+
+	for (n = 0; n < g->nnodes; n++)
+		if (!g->node[n].ndeps)
+			graph_push(r, n);
+}
+
+/*
+ * Take nodes off the ready FIFO and do them, pushing any successors that were
+ * only waiting on them, until the layer is done.  node is the NUMA node of
+ * the worker, or -1 for the session thread.  Workers go back to the op ring if
+ * nothing becomes ready for them for a while, or at once if ops queued after
+ * ours (the graph's op, op) are waiting for threads; whoever is doing a node
+ * always carries on after it, so the session thread is never left alone with
+ * work it can't see.
+ */
+
+void
+clamma_graph_run(txf_state_t *s, int node, unsigned long op)
+{
+	const clamma_graph_t *g = &s->tss.t->graph;
+	clamma_graph_run_t *r = &s->g;
+#if defined(LIBCLAMMA_SMP)
+	uint64_t spin_ns = smp_spin_ns;
+#else
+	uint64_t spin_ns = 0;
+#endif
+	unsigned int spins = 0, i;
+	uint64_t t0 = 0;
+	long h, k;
+
+	while ((unsigned long)clamma_atomic_load(&r->done) < g->nnodes) {
+		const clamma_gnode_t *gn;
+
+		h = clamma_atomic_load(&r->head);
+		if (h == clamma_atomic_load(&r->tail)) {
+			if (node >= 0 && !(spins++ & 63)) {
+				uint64_t now = clamma_timestamp_ns();
+
+				if (clamma_smp_ops_waiting(&s->tss, op))
+					return;
+				if (!t0)
+					t0 = now;
+				else if (now - t0 > spin_ns)
+					return;
 			}
+			clamma_cpu_relax();
+			continue;
 		}
 
-		/*
-		 * final session_matmul to get the output of the attention
-		 *
-		 * tss->xb2 = matmul(tss->xb, wo)
-		 */
+		if (!clamma_atomic_cas(&r->head, h, h + 1))
+			continue;
 
-		switch (t->c.version) {
-		case CLAMMA_MODEL_VERSION1_FLOAT:
-			if (session_matmul(tss, tss->xb2, tss->xb,
-				        (txi_t *)t->w.wo +
-				        l * t->c.dim * t->c.dim,
-					t->c.dim, t->c.dim))
-				goto bail;
-			break;
-		case CLAMMA_MODEL_VERSION2_INT8_80:
-			quantize(t, &tss->xq, tss->xb, t->c.dim);
-			if (session_matmul_qt(tss, tss->xb2, &tss->xq, t->w.wo + l,
-					   t->c.dim, t->c.dim))
-				goto bail;
-			break;
-		}
-		clamma_smp_sync_point(tss);
+		/* it's reserved, but the pusher may not have stored it yet */
+		while (!(k = clamma_atomic_load(&r->ready[h])))
+			clamma_cpu_relax();
 
-		/* residual connection goes back into ts->s.x */
+		gn = &g->node[k - 1];
+		if (graph_op(s, gn, node))
+			clamma_atomic_store(&r->failed, 1);
 
-		/*
-		 * ---->  All tss threads must be idle by here
-		 *
-		 * ts->s.x += tss->xb2
-		 */
+		for (i = 0; i < gn->nsucc; i++) {
+			uint32_t n = g->succ[gn->succ + i];
 
-		for (uint32_t i = 0; i < t->c.dim; i++)
-			ts->s.x[i] += tss->xb2[i];
+			if (clamma_atomic_add(&r->pending[n], -1) == 1)
+				graph_push(r, n);
+		}
 
-		/*
-		 * this section parallelizeable  ---->
-		 */
+		clamma_atomic_add(&r->done, 1);
+		spins = 0;
+		t0 = 0;
+	}
+}
 
-		/* ffn rmsnorm
-		 *
-		 *   tss->xb <- matmul(ts->s.x, rms_ffn_weight)
-		 */
-		if (session_rmsnorm(t, tss->xb, ts->s.x,
-			     t->w.rms_ffn_weight + l * t->c.dim, t->c.dim))
+tok_id_t
+clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
+{
+	const txf_t *t = ts->t;
+	float *content_row = t->w.token_embedding_table + (token * t->c.dim);
+	const float *f = content_row;
+	txf_session_state_t *tss = &ts->s.tss;
+
+	switch (t->c.version) {
+	case CLAMMA_MODEL_VERSION1_FLOAT:
+		f = clamma_weight_cache(t, content_row,
+					t->c.dim * sizeof(*ts->s.x));
+		if (!f)
 			goto bail;
+		break;
+	}
 
-		/*
-		 * Now for FFN in PyTorch we have:
-		 * self.w2(F.silu(self.w1(ts->s.x)) * self.w3(ts->s.x))
-		 * first calculate self.w1(ts->s.x) and self.w3(ts->s.x)
-		 *
-		 *   tss->hb <- matmul(tss->xb, w1)
-		 *   tss->hb2 <- matmul(tss->xb, w3)
-		 */
+	/*
+	 * Copy the initial token embedding into ts->s.x, this is updated twice
+	 * per layer with "residuals"
+	 */
 
-		switch (t->c.version) {
-		case CLAMMA_MODEL_VERSION1_FLOAT:
-			if (session_matmul(tss, tss->hb,  tss->xb,
-					   (txi_t *)t->w.w1 +
-					   l * t->c.dim * t->c.hidden_dim,
-					   t->c.dim, t->c.hidden_dim) ||
-			    session_matmul(tss, tss->hb2, tss->xb,
-					   (txi_t *)t->w.w3 +
-					   l * t->c.dim * t->c.hidden_dim,
-				           t->c.dim, t->c.hidden_dim))
-				goto bail;
-			break;
-		case CLAMMA_MODEL_VERSION2_INT8_80:
-			quantize(t, &tss->xq, tss->xb, t->c.dim);
-			if (session_matmul_qt(tss, tss->hb, &tss->xq, t->w.w1 + l,
-					      t->c.dim, t->c.hidden_dim) ||
-			    session_matmul_qt(tss, tss->hb2, &tss->xq, t->w.w3 + l,
-					      t->c.dim, t->c.hidden_dim))
-				goto bail;
-			break;
-		}
-		clamma_smp_sync_point(tss);
+	memcpy(ts->s.x, f, t->c.dim * sizeof(*ts->s.x));
+	if (f != content_row)
+		clamma_weight_cache_release(t, f);
 
-		/* SwiGLU non-linearity
-		 *
-		 *  munge tss->hb
-		 */
-		for (uint32_t i = 0; i < t->c.hidden_dim; i++)
-			/*
-			 * silu(ts->s.x)=ts->s.x*σ(ts->s.x), where σ(ts->s.x)
-			 * is the logistic sigmoid
-			 * elementwise multiply with w3(ts->s.x)
-			 */
-			tss->hb[i] = (tss->hb[i] * (1.0f /
-				     (1.0f + expf(-tss->hb[i])))) * tss->hb2[i];
+	/* make sure layer 0 is on its way, if it's not already */
+	clamma_weight_cache_prefetch(t, 0);
 
-		/*
-		 * tss->xb <-- tss->hb, w2
-		 */
+	/* for each layer... */
 
-		switch (t->c.version) {
-		case CLAMMA_MODEL_VERSION1_FLOAT:
-			/* final session_matmul to get the output of the ffn */
-			if (session_matmul(tss, tss->xb, tss->hb,
-				    (txi_t *)t->w.w2 +
-				    l * t->c.dim * t->c.hidden_dim,
-				    t->c.hidden_dim, t->c.dim))
-				goto bail;
-			break;
-		case CLAMMA_MODEL_VERSION2_INT8_80:
-			quantize(t, &tss->hq, tss->hb, t->c.hidden_dim);
-			if (session_matmul_qt(tss, tss->xb, &tss->hq, t->w.w2 + l,
-					t->c.hidden_dim, t->c.dim))
-				goto bail;
-			break;
-		}
-		clamma_smp_sync_point(tss);
+	for (uint64_t l = 0; l < t->c.n_layers; l++) {
 
-		/*
-		 * -----> All tss threads must be idle by here
-		 */
+		/* start bringing in the next layer's weights meanwhile */
+		clamma_weight_cache_prefetch(t, l + 1);
 
-		/* residual connection goes back into ts->s.x
-		 *
-		 * ts->s.x += tss->xb
+		/*
+		 * The layer's ops each start as soon as what they read is
+		 * ready, so the threads only all have to meet once per layer
 		 */
 
-		for (uint32_t i = 0; i < t->c.dim; i++)
-			ts->s.x[i] += tss->xb[i];
+		graph_start(&ts->s, (unsigned int)l, pos);
+		session_graph(tss);
+		clamma_smp_sync_point(tss);
 
-		// fprintf(stderr, "%f\n", (double)(clamma_timestamp_ns() - start) / 1000000000.0);
+		if (clamma_atomic_load(&ts->s.g.failed))
+			goto bail;
 	} /* per layer */
 
 	/*
@@ -473,6 +835,9 @@ clamma_session_forward(txf_session_t *ts, int is_prompt, int token, int pos)
 	 *
 	 *  ts->s.x <-- matmul(ts.s.x, rms_final_weight)
 	 */
+
+	clamma_weight_cache_prefetch(t, 0); /* for the next token */
+
 	if (session_rmsnorm(t, ts->s.x, ts->s.x, t->w.rms_final_weight, t->c.dim))
 		goto bail;
 
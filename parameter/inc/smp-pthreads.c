@@ -37,19 +37,389 @@
 
 #include "private.h"
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+static clamma_affinity_t affinity;
+static unsigned int steppers = 1;
+static const char *affinity_name[] = { "none", "cores", "cpus", "isolated" };
+
+#if defined(__linux__) && defined(CPU_SETSIZE)
+#define CLAMMA_NUMA
+#define CLAMMA_AFFINITY
+
+/* the cpus we may use on each NUMA node that has any */
+static cpu_set_t numa_cpus[CLAMMA_NUMA_MAX];
+
+/* tells the pools apart for the stepping thread placement */
+static unsigned int place_gen;
+static cpu_set_t affinity_cpus, allowed_cpus;
+static char have_allowed;
+
+static int
+cpulist_parse(const char *s, cpu_set_t *set)
+{
+	unsigned long a, b;
+	char *e;
+
+	CPU_ZERO(set);
+
+	while (*s && *s != '\n') {
+		a = b = strtoul(s, &e, 10);
+		if (e == s)
+			return 1;
+		if (*e == '-') {
+			s = e + 1;
+			b = strtoul(s, &e, 10);
+			if (e == s)
+				return 1;
+		}
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		s = e;
+		if (*s == ',')
+			s++;
+	}
+
+	return 0;
+}
+
+static void
+cpulist_format(const cpu_set_t *set, char *buf, size_t len)
+{
+	size_t n = 0;
+	int a, b;
+
+	buf[0] = '\0';
+
+	for (a = 0; a < CPU_SETSIZE && n < len; a++) {
+		if (!CPU_ISSET(a, set))
+			continue;
+		for (b = a; b + 1 < CPU_SETSIZE && CPU_ISSET(b + 1, set); b++)
+			;
+		if (b == a)
+			n += (size_t)snprintf(buf + n, len - n, "%s%d",
+					      n ? "," : "", a);
+		else
+			n += (size_t)snprintf(buf + n, len - n, "%s%d-%d",
+					      n ? "," : "", a, b);
+		a = b;
+	}
+}
+
+static int
+sysfs_cpulist(const char *path, cpu_set_t *set)
+{
+	char line[1024];
+	int ret = 1;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 1;
+	if (fgets(line, sizeof(line), f))
+		ret = cpulist_parse(line, set);
+	fclose(f);
+
+	return ret;
+}
+
+/*
+ * The cpus the process may run on, as it was before we pinned the stepping
+ * thread to one of them
+ */
+
+static int
+allowed_get(cpu_set_t *allowed)
+{
+	if (!have_allowed) {
+		if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus))
+			return 1;
+		have_allowed = 1;
+	}
+
+	*allowed = allowed_cpus;
+
+	return 0;
+}
+
+/*
+ * Find the NUMA nodes with cpus we're allowed to run on.  Memory-only nodes,
+ * and nodes our affinity mask excludes, aren't counted.
+ */
+
+static void
+numa_detect(void)
+{
+	cpu_set_t online, allowed;
+	char path[64];
+	int id;
+
+	numa_nodes = 0;
+
+	if (sysfs_cpulist("/sys/devices/system/node/online", &online) ||
+	    allowed_get(&allowed))
+		return;
+
+	for (id = 0; id < CPU_SETSIZE && numa_nodes < CLAMMA_NUMA_MAX; id++) {
+		cpu_set_t *cs = &numa_cpus[numa_nodes];
+
+		if (!CPU_ISSET(id, &online))
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/node/node%d/cpulist", id);
+		if (sysfs_cpulist(path, cs))
+			continue;
+
+		CPU_AND(cs, cs, &allowed);
+		if (CPU_COUNT(cs))
+			numa_node_id[numa_nodes++] = id;
+	}
+}
+
+/*
+ * Work out which cpus the affinity policy places the pool's threads on.  For
+ * cores, that is the first hardware thread we may use of each physical core,
+ * so SMT siblings are left alone.  Isolated cpus aren't in our affinity mask
+ * to start with, so they're taken as they are and it's up to the kernel to
+ * refuse them.  The stepping threads get the first, the workers are dealt the
+ * rest in turn.
+ */
+
+static int
+place_detect(clamma_pool_t *pool)
+{
+	cpu_set_t allowed, set, sib;
+	char path[96];
+	int cpu, first;
+
+	pool->affinity = affinity;
+	pool->place_gen = ++place_gen;
+
+	if (allowed_get(&allowed))
+		return 1;
+
+	CPU_ZERO(&set);
+
+	switch (affinity) {
+	case CLAMMA_AFFINITY_CORES:
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+			if (!CPU_ISSET(cpu, &allowed))
+				continue;
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/"
+				 "cpu%d/topology/thread_siblings_list", cpu);
+			if (sysfs_cpulist(path, &sib)) {
+				CPU_ZERO(&sib);
+				CPU_SET(cpu, &sib);
+			}
+			CPU_AND(&sib, &sib, &allowed);
+			for (first = 0; first < cpu; first++)
+				if (CPU_ISSET(first, &sib))
+					break;
+			if (first == cpu)
+				CPU_SET(cpu, &set);
+		}
+		break;
+	case CLAMMA_AFFINITY_CPUS:
+		CPU_AND(&set, &affinity_cpus, &allowed);
+		if (CPU_COUNT(&set) != CPU_COUNT(&affinity_cpus))
+			fprintf(stderr, "%s: some requested cpus aren't "
+					"allowed, ignoring them\n", __func__);
+		break;
+	case CLAMMA_AFFINITY_ISOLATED:
+		if (sysfs_cpulist("/sys/devices/system/cpu/isolated", &set))
+			CPU_ZERO(&set);
+		break;
+	default:
+		return 0;
+	}
+
+	if (!CPU_COUNT(&set)) {
+		fprintf(stderr, "%s: no cpus for affinity policy %s\n",
+				__func__, affinity_name[affinity]);
+		return 1;
+	}
+
+	pool->place_cpu = malloc(sizeof(int) * (size_t)CPU_COUNT(&set));
+	if (!pool->place_cpu)
+		return 1;
+
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if (CPU_ISSET(cpu, &set))
+			pool->place_cpu[pool->place_count++] = cpu;
+
+	/* leave the workers at least one */
+	pool->place_steppers = steppers;
+	if (pool->place_steppers >= pool->place_count)
+		pool->place_steppers = pool->place_count > 1 ?
+						pool->place_count - 1 : 1;
+
+	return 0;
+}
+
+/* the cpu worker n is placed on, and the NUMA node that belongs to */
+
+static int
+place_worker(const clamma_pool_t *pool, unsigned int n, unsigned int *node)
+{
+	unsigned int ns = pool->place_steppers;
+	int cpu = pool->place_count > ns ?
+			pool->place_cpu[ns + n % (pool->place_count - ns)] :
+			pool->place_cpu[0];
+	unsigned int m;
+
+	*node = 0;
+	for (m = 0; m < numa_nodes; m++)
+		if (CPU_ISSET(cpu, &numa_cpus[m]))
+			*node = m;
+
+	return cpu;
+}
+#endif
+
+/*
+ * Choose how the worker threads and the stepping thread are placed on cpus.
+ * This applies to the pools created afterwards, including the ones models make
+ * for themselves at construct, so different pools can be given different cpus.
+ * cpus is a list like "0-3,8" for CLAMMA_AFFINITY_CPUS and is otherwise
+ * ignored.
+ */
+
+int
+clamma_smp_affinity(clamma_affinity_t policy, const char *cpus)
+{
+#if defined(CLAMMA_AFFINITY)
+	cpu_set_t set;
+#endif
+
+	if ((unsigned int)policy > CLAMMA_AFFINITY_ISOLATED)
+		return 1;
+
+#if defined(CLAMMA_AFFINITY)
+	if (policy == CLAMMA_AFFINITY_CPUS) {
+		if (!cpus || cpulist_parse(cpus, &set) || !CPU_COUNT(&set)) {
+			fprintf(stderr, "%s: bad cpu list\n", __func__);
+			return 1;
+		}
+		affinity_cpus = set;
+	}
+#else
+	(void)cpus;
+	if (policy != CLAMMA_AFFINITY_NONE) {
+		fprintf(stderr, "%s: not supported on this platform\n",
+				__func__);
+		return 1;
+	}
+#endif
+
+	affinity = policy;
+
+	return 0;
+}
+
+/*
+ * How many threads will call clamma_sessions_step_next() at once, so the pools
+ * created afterwards keep a cpu for each of them ahead of the workers when the
+ * affinity policy places threads.
+ */
+
+int
+clamma_smp_steppers(unsigned int n)
+{
+	if (!n)
+		return 1;
+
+	steppers = n;
+
+	return 0;
+}
+
+/*
+ * Pin the calling thread to one of the stepping cpus of the pool whose model
+ * it's about to step, if that pool places threads.  Threads coming to the pool
+ * are dealt its stepping cpus in turn.  A thread stepping models on several
+ * pools is allowed on the cpus it was dealt by each of them, so it isn't
+ * moved back and forth.  It's cheap to call on every step, it only does
+ * anything the first time the thread sees a pool.
+ */
+
+#define CLAMMA_PLACE_POOLS 8
+
 void
-clamma_smp_sync_point(txf_session_state_t *tss)
+clamma_smp_place_caller(clamma_pool_t *pool)
 {
-	do {
-		clamma_sem_wait(&tss->sem_done);
-		if (!tss->queued)
+#if defined(CLAMMA_AFFINITY)
+	static __thread unsigned int placed[CLAMMA_PLACE_POOLS], nplaced;
+	static __thread cpu_set_t set;
+	unsigned int i;
+	long n;
+
+	if (!pool || !pool->place_count)
+		return;
+
+	for (i = 0; i < nplaced; i++)
+		if (placed[i] == pool->place_gen)
 			return;
-	} while (1);
+
+	if (nplaced == CLAMMA_PLACE_POOLS)
+		nplaced = 0; /* start over */
+	if (!nplaced)
+		CPU_ZERO(&set);
+
+	placed[nplaced++] = pool->place_gen;
+	n = clamma_atomic_add(&pool->place_next, 1);
+	CPU_SET(pool->place_cpu[(unsigned long)n % pool->place_steppers], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void)pool;
+#endif
+}
+
+/* describe where the pool's threads were placed, for the construct desc */
+
+void
+clamma_smp_describe(const clamma_pool_t *pool, char *buf, size_t len)
+{
+#if defined(CLAMMA_AFFINITY)
+	char step[64], workers[96];
+	unsigned int n, node;
+	cpu_set_t set;
+
+	if (pool->place_count) {
+		CPU_ZERO(&set);
+		for (n = 0; n < pool->count; n++)
+			CPU_SET(place_worker(pool, n, &node), &set);
+		cpulist_format(&set, workers, sizeof(workers));
+		CPU_ZERO(&set);
+		for (n = 0; n < pool->place_steppers; n++)
+			CPU_SET(pool->place_cpu[n], &set);
+		cpulist_format(&set, step, sizeof(step));
+		snprintf(buf, len, "affinity: %s, stepping: cpu%s %s, "
+			 "workers: cpus %s", affinity_name[pool->affinity],
+			 pool->place_steppers > 1 ? "s" : "", step, workers);
+		return;
+	}
+#endif
+
+	if (numa_nodes > 1)
+		snprintf(buf, len, "affinity: %s%s, workers pinned per NUMA "
+			 "node (%u)", affinity_name[pool->affinity],
+			 pool->affinity ? " (no cpus)" : "", numa_nodes);
+	else
+		snprintf(buf, len, "affinity: %s%s",
+			 affinity_name[pool->affinity],
+			 pool->affinity ? " (no cpus)" : "");
 }
 
 int
-clamma_smp_tss_init(txf_session_state_t *tss)
+clamma_smp_tss_init(txf_session_state_t *tss, clamma_pool_t *pool)
 {
+	clamma_atomic_store(&tss->queued, 0);
+	tss->nops = 0;
+	tss->pool = pool;
+
 	return clamma_sem_init(&tss->sem_done);
 }
 
@@ -61,60 +431,170 @@ clamma_smp_tss_deinit(txf_session_state_t *tss)
 
 void
 clamma_smp_deinit(void)
+{
+	if (--thread_init_refcount)
+		return;
+
+	pthread_mutex_destroy(&mut_sessions);
+	clamma_sem_destroy(&sem_sessions);
+	numa_nodes = 0;
+}
+
+/*
+ * The process-wide part, refcounted by the pools
+ */
+
+int
+clamma_smp_init(void)
+{
+	if (thread_init_refcount++)
+		return 0;
+
+#if defined(CLAMMA_NUMA)
+	numa_detect();
+	if (numa_nodes > 1)
+		fprintf(stderr, "%s: %u NUMA nodes, pinning workers per node\n",
+				__func__, numa_nodes);
+#endif
+
+	clamma_mutex_init(&mut_sessions);
+
+	return clamma_sem_init(&sem_sessions);
+}
+
+/*
+ * Drop a reference on the pool, the last one stops its threads and frees it.
+ * Whoever let go last must have no ops outstanding on it.
+ */
+
+void
+clamma_pool_destroy(clamma_pool_t *pool)
 {
 	void *vret;
 	unsigned int n;
 
-	if (--thread_init_refcount)
+	if (!pool || clamma_atomic_add(&pool->refcount, -1) != 1)
 		return;
 
-	for (n = 0; n < count_threads; n++)
-		if (work_threads[n].running) {
-			work_threads[n].exiting = 1;
-			clamma_sem_post(&work_threads[n].sem_start);
-			pthread_join(work_threads[n].pt, &vret);
-			clamma_sem_destroy(&work_threads[n].sem_start);
-			work_threads[n].running = 0;
+	for (n = 0; n < pool->count; n++)
+		if (pool->threads[n].running) {
+			clamma_atomic_store(&pool->threads[n].exiting, 1);
+			clamma_sem_post(&pool->threads[n].sem_start);
+			pthread_join(pool->threads[n].pt, &vret);
+			clamma_sem_destroy(&pool->threads[n].sem_start);
+			pool->threads[n].running = 0;
+			free(pool->threads[n].scratch);
 		}
 
-	pthread_mutex_destroy(&work.mut_job);
-	pthread_mutex_destroy(&mut_sessions);
-	count_threads = 0;
-	free(work_threads);
+	free(pool->threads);
+	free(pool->place_cpu);
+	free(pool);
+
+	clamma_smp_deinit();
 }
 
-int
-clamma_smp_init(unsigned int threads)
+/*
+ * Create a pool of worker threads with its own job ring, the caller holds a
+ * reference to it until clamma_pool_destroy().  threads may be 0, then if the
+ * affinity policy places threads we have one worker for each of its cpus after
+ * the stepping threads', otherwise 8.
+ */
+
+clamma_pool_t *
+clamma_pool_create(unsigned int threads)
 {
+	clamma_pool_t *pool;
 	unsigned int n;
 
-	if (thread_init_refcount++)
-		return 0;
+	if (clamma_smp_init())
+		return NULL;
 
-	work_threads = malloc(sizeof(*work_threads) * threads);
-	if (!work_threads)
-		return 1;
-	memset(work_threads, 0, sizeof(*work_threads) * threads);
-	count_threads = threads;
+	pool = malloc(sizeof(*pool));
+	if (!pool) {
+		clamma_smp_deinit();
+		return NULL;
+	}
+	memset(pool, 0, sizeof(*pool));
+	pool->refcount = 1;
+
+#if defined(CLAMMA_AFFINITY)
+	if (place_detect(pool))
+		fprintf(stderr, "%s: leaving threads unplaced\n", __func__);
+	if (!threads && pool->place_count)
+		threads = pool->place_count > pool->place_steppers ?
+			pool->place_count - pool->place_steppers : 1;
+#endif
+	if (!threads)
+		threads = 8;
+
+	pool->threads = malloc(sizeof(*pool->threads) * threads);
+	if (!pool->threads)
+		goto bail;
+	memset(pool->threads, 0, sizeof(*pool->threads) * threads);
+	pool->count = threads;
+
+	for (n = 0; n < pool->count; n++) {
+		work_threads_t *w = &pool->threads[n];
 
-	for (n = 0; n < count_threads; n++) {
-		if (clamma_sem_init(&work_threads[n].sem_start))
+		w->pool = pool;
+		if (clamma_sem_init(&w->sem_start))
 			goto bail;
 
-		if (pthread_create(&work_threads[n].pt, NULL,
-				   clamma_session_worker,
-				   &work_threads[n])) {
-			clamma_sem_destroy(&work_threads[n].sem_start);
-bail:
-			clamma_smp_deinit();
+		/* contiguous runs of workers share a node */
+		if (numa_nodes > 1)
+			w->node = (n * numa_nodes) / pool->count;
+#if defined(CLAMMA_AFFINITY)
+		/* ... unless the policy places them */
+		if (pool->place_count)
+			place_worker(pool, n, &w->node);
+#endif
 
-			return 1;
+		if (pthread_create(&w->pt, NULL, clamma_session_worker, w)) {
+			clamma_sem_destroy(&w->sem_start);
+			goto bail;
 		}
-		work_threads[n].running = 1;
+		w->running = 1;
+
+#if defined(CLAMMA_NUMA)
+		if (pool->place_count) {
+			cpu_set_t set;
+			unsigned int node;
+
+			CPU_ZERO(&set);
+			CPU_SET(place_worker(pool, n, &node), &set);
+			if (pthread_setaffinity_np(w->pt, sizeof(set), &set))
+				fprintf(stderr, "%s: unable to pin worker %u\n",
+						__func__, n);
+		} else if (numa_nodes > 1)
+			pthread_setaffinity_np(w->pt, sizeof(cpu_set_t),
+					       &numa_cpus[w->node]);
+#endif
 	}
 
-	clamma_mutex_init(&work.mut_job);
-	clamma_mutex_init(&mut_sessions);
+	return pool;
 
-	return 0;
+bail:
+	clamma_pool_destroy(pool);
+
+	return NULL;
+}
+
+int
+clamma_smp_thread_create(pthread_t *pt, void *(*fn)(void *), void *arg)
+{
+	return pthread_create(pt, NULL, fn, arg);
+}
+
+void
+clamma_smp_thread_join(pthread_t pt)
+{
+	void *vret;
+
+	pthread_join(pt, &vret);
+}
+
+int
+clamma_smp_mutex_trylock(clamma_mutex_t *m)
+{
+	return pthread_mutex_trylock(m);
 }
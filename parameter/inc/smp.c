@@ -30,9 +30,10 @@
 
 #include "private.h"
 
-work_threads_t *work_threads;
-work_t work;
-unsigned int count_threads, thread_init_refcount;
+unsigned int thread_init_refcount;
+unsigned int numa_nodes;
+int numa_node_id[CLAMMA_NUMA_MAX];
+uint64_t smp_spin_ns = 50000;
 
 // #define SESSION_THREAD_SHOW_OCCUPANCY
 // #define LOG_MATRIX_MUL
@@ -42,85 +43,486 @@ unsigned int count_threads, thread_init_refcount;
 int fd_log = -1, log_line = 1;
 #endif
 
+/*
+ * If the model has been replicated per NUMA node, point the worker at its own
+ * node's copy of weights in the replicated range
+ */
+
+const void *
+clamma_numa_local(int node, const txf_t *t, const void *p)
+{
+	const uint8_t *b = (const uint8_t *)p;
+
+	if (node < 0 || !t || !t->numa_len || !t->numa_copy[node] ||
+	    b < t->numa_base || b >= t->numa_base + t->numa_len)
+		return p;
+
+	return t->numa_copy[node] + (b - t->numa_base);
+}
+
+/* the pool doing t's ops */
+
+clamma_pool_t *
+clamma_txf_pool(const txf_t *t)
+{
+	return t->pool;
+}
+
+/*
+ * Move t's ops over to pool, eg, so several models share one, letting go of
+ * the pool it was using.  It can't have any sessions at the time.
+ */
+
+int
+clamma_txf_pool_attach(txf_t *t, clamma_pool_t *pool)
+{
+	clamma_pool_t *old;
+
+	if (!pool)
+		return 1;
+
+	clamma_mutex_lock(&mut_sessions);
+	if (t->sess_count) {
+		clamma_mutex_unlock(&mut_sessions);
+		fprintf(stderr, "%s: %s: has sessions\n", __func__, t->name);
+		return 1;
+	}
+	clamma_atomic_add(&pool->refcount, 1);
+	old = t->pool;
+	t->pool = pool;
+	t->v.pool = pool;
+	clamma_mutex_unlock(&mut_sessions);
+
+	clamma_pool_destroy(old);
+
+	return 0;
+}
+
+/*
+ * How long workers and waiting sessions spin looking for work or completion,
+ * before sleeping on a semaphore.  0 means always sleep.
+ */
+
+void
+clamma_smp_spin(uint64_t ns)
+{
+	smp_spin_ns = ns;
+}
+
+/*
+ * Do chunk c of op j (ring index k), then account for it in the op and its
+ * session.  node is the NUMA node of the worker doing it, or -1 if it's the
+ * session's own thread.
+ */
+
+static void
+job_run(job_t *j, unsigned long k, unsigned int c, int node, char **scratch,
+	size_t *scratch_len)
+{
+	txf_session_state_t *tss = j->tss;
+	int i = (int)c * j->chunk,
+	    lim = c == j->nchunks - 1 ? j->end : i + j->chunk;
+	qt_t lq;
+
+	switch (j->type) {
+	case CLAMMA_JOB_MATMUL:
+		_session_matmul(tss, j->xout, j->x,
+				clamma_numa_local(node, tss->t, j->w1), i, lim,
+				j->n, j->d);
+		break;
+	case CLAMMA_JOB_MATMUL_QT:
+		lq.q = (cq_t *)clamma_numa_local(node, tss->t, j->qt_w->q);
+		lq.s = (float *)clamma_numa_local(node, tss->t, j->qt_w->s);
+		_session_matmul_qt(tss, j->xout, j->qt_x, &lq, i, lim, j->n,
+				   j->d);
+		break;
+	case CLAMMA_JOB_VOCAB_ENCODE:
+	case CLAMMA_JOB_VOCAB_DECODE:
+		if (clamma_vocab_batch_run(j->vb, j->type, (size_t)i,
+					   (size_t)lim, scratch, scratch_len))
+			clamma_atomic_store(&j->vb->failed, 1);
+		break;
+	case CLAMMA_JOB_PREFAULT:
+		clamma_prefault_run(j->mem + i, (size_t)(lim - i));
+		break;
+	case CLAMMA_JOB_GRAPH:
+		clamma_graph_run((txf_state_t *)((char *)tss -
+					offsetof(txf_state_t, tss)), node, k);
+		break;
+	}
+
+	/* the slot may be reused as soon as left reaches 0 */
+
+	clamma_atomic_add(&j->left, -1);
+
+	/*
+	 * tss may go away as soon as queued reaches 0, so the owner tells us
+	 * it's asleep in bit 0, rather than anything we'd look at afterwards
+	 */
+	if (clamma_atomic_add(&tss->queued, -2) == 3)
+		clamma_sem_post(&tss->sem_done);
+}
+
+/*
+ * The workers, and the session thread at its sync point, each own one of the
+ * op's parts, which can't be more than CLAMMA_JOB_MAX_PARTS
+ */
+
+static unsigned int
+job_nparts(const clamma_pool_t *pool)
+{
+	return pool->count + 1 < CLAMMA_JOB_MAX_PARTS ? pool->count + 1 :
+							CLAMMA_JOB_MAX_PARTS;
+}
+
+/*
+ * Take the next chunk from the front of our own part.  If the slot moved on to
+ * a later op between our look and the claim, we claimed a chunk of that op
+ * instead, it can't be completed without us so the slot still holds it.
+ */
+
+static int
+job_claim_own(job_t *j, unsigned int p, unsigned int *c)
+{
+	uint64_t v = (uint64_t)clamma_atomic_add64(&j->part[p], 1);
+
+	*c = (unsigned int)(v & 0xffff);
+
+	return *c < (unsigned int)((v >> 16) & 0xffff);
+}
+
+/* take the last chunk from the back of someone else's part of op gen */
+
+static int
+job_claim_steal(job_t *j, unsigned int p, uint32_t gen, unsigned int *c)
+{
+	uint64_t v;
+
+	do {
+		v = (uint64_t)clamma_atomic_load64(&j->part[p]);
+		if ((uint32_t)(v >> 32) != gen ||
+		    (v & 0xffff) >= ((v >> 16) & 0xffff))
+			return 0;
+	} while (!clamma_atomic_cas64(&j->part[p], (int64_t)v,
+				      (int64_t)(v - (1ull << 16))));
+
+	*c = (unsigned int)((v >> 16) & 0xffff) - 1;
+
+	return 1;
+}
+
+/*
+ * Do what we can of op k in slot j, starting with our own part, then stealing
+ * from the others' parts in turn.  Returns the number of chunks we did.
+ */
+
+static unsigned int
+job_work(job_t *j, unsigned long k, unsigned int home, int node,
+	 char **scratch, size_t *scratch_len, unsigned int *steals)
+{
+	unsigned int c, p, n, np = j->nparts, done = 0;
+
+	home %= np;
+
+	while (job_claim_own(j, home, &c)) {
+		job_run(j, k, c, node, scratch, scratch_len);
+		done++;
+	}
+
+	for (n = 1; n < np; n++) {
+		p = (home + n) % np;
+		while (job_claim_steal(j, p, (uint32_t)(k + 1), &c)) {
+			job_run(j, k, c, node, scratch, scratch_len);
+			done++;
+			(*steals)++;
+		}
+	}
+
+	return done;
+}
+
+/*
+ * Is there an op at our cursor, or has the ring moved past it?  The op may be
+ * reserved by a producer, but not published yet.
+ */
+
+static int
+worker_has_work(const work_threads_t *w)
+{
+	const work_t *wk = &w->pool->work;
+	const job_t *j = &wk->job_ring[w->cursor %
+				       CLAMMA_ARRAY_SIZE(wk->job_ring)];
+
+	if (w->cursor == (unsigned long)clamma_atomic_load(&wk->job_head))
+		return 0;
+
+	return (int32_t)((uint32_t)clamma_atomic_load(&j->gen) -
+			 (uint32_t)(w->cursor + 1)) >= 0;
+}
+
 void *
 clamma_session_worker(void *tp)
 {
 	work_threads_t *w = (work_threads_t *)tp;
+	work_t *wk = &w->pool->work;
+	unsigned int home = (unsigned int)(w - w->pool->threads);
 #if defined(SESSION_THREAD_SHOW_OCCUPANCY)
-	uint64_t ns = 0, begin = clamma_timestamp_ns(), start, end;
+	uint64_t begin = clamma_timestamp_ns(), end;
 #endif
 
 	while (1) {
-		job_t temp;
-
-		clamma_sem_wait(&w->sem_start);
+		unsigned int spins, done, steals = 0;
+		uint64_t t0 = 0;
+		job_t *j;
 
-		while (1) { /* while jobs in ring to do */
+		/* spin a while first, the next op is usually right behind */
 
-			if (w->exiting)
-				goto bail;
+		for (spins = 0; smp_spin_ns && !worker_has_work(w); spins++) {
+			if (!(spins & 63)) {
+				uint64_t now = clamma_timestamp_ns();
 
-			clamma_mutex_lock(&work.mut_job);
-			if (work.job_tail == work.job_head) {
-				/* ring is empty, wait for sem */
-				clamma_mutex_unlock(&work.mut_job);
-				break;
+				if (!t0)
+					t0 = now;
+				else if (now - t0 > smp_spin_ns)
+					break;
 			}
-			temp = work.job_ring[work.job_tail];
-			work.job_tail = (work.job_tail + 1) %
-					CLAMMA_ARRAY_SIZE(work.job_ring);
-			clamma_mutex_unlock(&work.mut_job);
+			clamma_cpu_relax();
+		}
 
-#if defined(SESSION_THREAD_SHOW_OCCUPANCY)
-			start = clamma_timestamp_ns();
-#endif
-			switch (temp.type) {
-			case CLAMMA_JOB_MATMUL:
-				_session_matmul(temp.tss, temp.xout, temp.x,
-						temp.w1, temp.i, temp.dlim,
-						temp.n, temp.d);
-			break;
-			case CLAMMA_JOB_MATMUL_QT:
-				_session_matmul_qt(temp.tss, temp.xout,
-						   temp.qt_x, temp.qt_w, temp.i,
-						   temp.dlim, temp.n, temp.d);
-			break;
-			}
-#if defined(SESSION_THREAD_SHOW_OCCUPANCY)
-			ns += clamma_timestamp_ns() - start;
-#endif
+		if (!worker_has_work(w)) {
+			/*
+			 * Tell the producers we want a post, then check again
+			 * in case an op was published before they could see it
+			 */
+			clamma_atomic_store(&w->sleeping, 1);
+			if (worker_has_work(w) &&
+			    clamma_atomic_xchg(&w->sleeping, 0))
+				continue;
+			/* a producer saw us sleeping, and will post */
+			clamma_sem_wait(&w->sem_start);
+			if (clamma_atomic_load(&w->exiting))
+				goto bail;
+			continue;
+		}
+
+		j = &wk->job_ring[w->cursor % CLAMMA_ARRAY_SIZE(wk->job_ring)];
 
-			clamma_mutex_lock(&work.mut_job);
-			assert(temp.tss->queued);
-			if (!--temp.tss->queued)
-				/* let tss know its jobs are completed */
-				clamma_sem_post(&temp.tss->sem_done);
+		if ((uint32_t)clamma_atomic_load(&j->gen) !=
+						(uint32_t)(w->cursor + 1)) {
+			/* the slot was reused, so our op was completed */
+			w->cursor++;
+			continue;
+		}
 
-			clamma_mutex_unlock(&work.mut_job);
+		t0 = clamma_timestamp_ns();
+		done = job_work(j, w->cursor, home, (int)w->node, &w->scratch,
+				&w->scratch_len, &steals);
+		if (done) {
+			clamma_atomic_add64(&w->busy_ns,
+				(int64_t)(clamma_timestamp_ns() - t0));
+			clamma_atomic_add64(&w->chunks, (int64_t)done);
+			clamma_atomic_add64(&w->steals, (int64_t)steals);
 		}
+
+		/* every chunk of it has been claimed by someone */
+		w->cursor++;
 	}
 
 bail:
 #if defined(SESSION_THREAD_SHOW_OCCUPANCY)
 	end = clamma_timestamp_ns();
-	fprintf(stderr, "t%d: %llums / %llums\n", (int)(w - work_threads),
-			(unsigned long long)ns / 1000000ull,
-			(end - begin) / 1000000ull);
+	fprintf(stderr, "t%d: %llums / %llums, %lld chunks, %lld stolen\n",
+			(int)home,
+			(unsigned long long)w->busy_ns / 1000000ull,
+			(unsigned long long)(end - begin) / 1000000ull,
+			(long long)w->chunks, (long long)w->steals);
 #endif
 
 	pthread_exit(NULL);
 }
 
+/*
+ * Report what worker n has done since the threads started, so it can be seen
+ * how evenly the work spreads over the cores.  Returns 1 if no such worker.
+ */
+
+int
+clamma_smp_worker_stats(const clamma_pool_t *pool, unsigned int n,
+			uint64_t *busy_ns, uint64_t *chunks, uint64_t *steals)
+{
+	if (!pool || n >= pool->count)
+		return 1;
+
+	*busy_ns = (uint64_t)clamma_atomic_load64(&pool->threads[n].busy_ns);
+	*chunks = (uint64_t)clamma_atomic_load64(&pool->threads[n].chunks);
+	*steals = (uint64_t)clamma_atomic_load64(&pool->threads[n].steals);
+
+	return 0;
+}
+
+/*
+ * Claim and do chunks of op k, for a session waiting on it.  We own the last
+ * part, the workers own the others.
+ */
+
+static void
+job_help(clamma_pool_t *pool, unsigned long k, char **scratch,
+	 size_t *scratch_len)
+{
+	job_t *j = &pool->work.job_ring[k %
+				CLAMMA_ARRAY_SIZE(pool->work.job_ring)];
+	unsigned int steals = 0;
+
+	if ((uint32_t)clamma_atomic_load(&j->gen) == (uint32_t)(k + 1))
+		job_work(j, k, job_nparts(pool) - 1, -1, scratch, scratch_len,
+			 &steals);
+}
+
+/*
+ * Set jt up to be split into chunks of at least min units, in multiples of
+ * align, aiming for per_part chunks in each part so faster threads can take
+ * more of them.  Returns the number of chunks.
+ */
+
+static unsigned int
+job_split(job_t *jt, int end, int per_part, int min, int align)
+{
+	int chunk = end / (int)(job_nparts(jt->tss->pool) *
+				(unsigned int)per_part);
+
+	if (chunk < min)
+		chunk = min;
+	if ((end + chunk - 1) / chunk > CLAMMA_JOB_MAX_CHUNKS)
+		chunk = (end + CLAMMA_JOB_MAX_CHUNKS - 1) /
+						CLAMMA_JOB_MAX_CHUNKS;
+	chunk = ((chunk + align - 1) / align) * align;
+
+	jt->chunk	= chunk;
+	jt->end		= end;
+
+	return end ? (unsigned int)((end + chunk - 1) / chunk) : 1;
+}
+
+/*
+ * Publish the op described by jt, split into nchunks of jt->chunk, the last
+ * taking up the rest to jt->end.  The chunks are dealt out in contiguous runs
+ * to the parts.  Producers reserve a ring slot by adding to job_head, then
+ * wait for the op that last used the slot to be completed.
+ */
+
+static void
+job_queue(const job_t *jt, unsigned int nchunks)
+{
+	clamma_pool_t *pool = jt->tss->pool;
+	work_t *wk = &pool->work;
+	unsigned long k = (unsigned long)clamma_atomic_add(&wk->job_head, 1);
+	uint32_t prev = (uint32_t)(k + 1 - CLAMMA_ARRAY_SIZE(wk->job_ring));
+	job_t *j = &wk->job_ring[k % CLAMMA_ARRAY_SIZE(wk->job_ring)];
+	unsigned int m, np = job_nparts(pool);
+
+	assert(nchunks && nchunks <= CLAMMA_JOB_MAX_CHUNKS);
+
+	/* the ring needs to be bigger if we wait here often */
+	while ((k >= CLAMMA_ARRAY_SIZE(wk->job_ring) &&
+		(uint32_t)clamma_atomic_load(&j->gen) != prev) ||
+	       clamma_atomic_load(&j->left))
+		usleep(1);
+
+	j->tss		= jt->tss;
+	j->type		= jt->type;
+	j->xout		= jt->xout;
+	j->x		= jt->x;
+	j->w1		= jt->w1;
+	j->qt_x		= jt->qt_x;
+	j->qt_w		= jt->qt_w;
+	j->vb		= jt->vb;
+	j->mem		= jt->mem;
+	j->n		= jt->n;
+	j->d		= jt->d;
+	j->chunk	= jt->chunk;
+	j->end		= jt->end;
+	j->nchunks	= nchunks;
+	j->nparts	= np;
+
+	clamma_atomic_add(&jt->tss->queued, 2 * (long)nchunks);
+	clamma_atomic_store(&j->left, (long)nchunks);
+
+	/* so the session can help with it when it syncs */
+	if (jt->tss->nops < CLAMMA_ARRAY_SIZE(jt->tss->ops))
+		jt->tss->ops[jt->tss->nops++] = k;
+
+	/* each part can be claimed from as soon as it's stored */
+	for (m = 0; m < np; m++)
+		clamma_atomic_store64(&j->part[m],
+			(int64_t)(((uint64_t)(uint32_t)(k + 1) << 32) |
+				  ((uint64_t)((m + 1) * nchunks / np) << 16) |
+				  (uint64_t)(m * nchunks / np)));
+
+	/* this makes it visible to the workers */
+	clamma_atomic_store(&j->gen, (long)(uint32_t)(k + 1));
+
+	for (m = 0; m < pool->count; m++)
+		if (clamma_atomic_load(&pool->threads[m].sleeping) &&
+		    clamma_atomic_xchg(&pool->threads[m].sleeping, 0))
+			clamma_sem_post(&pool->threads[m].sem_start);
+}
+
+/*
+ * Wait for the ops tss queued to complete.  Rather than sit idle, we first
+ * take chunks of them ourselves alongside the workers, then spin for a while
+ * on the completion count, and only then sleep until the last chunk is done.
+ */
+
+void
+clamma_smp_sync_point(txf_session_state_t *tss)
+{
+	char *scratch = NULL;
+	size_t scratch_len = 0;
+	unsigned int n, spins;
+	uint64_t t0 = 0;
+	long q;
+
+	for (n = 0; n < tss->nops; n++)
+		job_help(tss->pool, tss->ops[n], &scratch, &scratch_len);
+	tss->nops = 0;
+	free(scratch);
+
+	for (spins = 0; smp_spin_ns && clamma_atomic_load(&tss->queued);
+								spins++) {
+		if (!(spins & 63)) {
+			uint64_t now = clamma_timestamp_ns();
+
+			if (!t0)
+				t0 = now;
+			else if (now - t0 > smp_spin_ns)
+				break;
+		}
+		clamma_cpu_relax();
+	}
+
+	/* set bit 0, so whoever completes the last chunk posts us */
+
+	do {
+		q = clamma_atomic_load(&tss->queued);
+		if (!q)
+			return;
+	} while (!clamma_atomic_cas(&tss->queued, q, q | 1));
+
+	clamma_sem_wait(&tss->sem_done);
+	clamma_atomic_store(&tss->queued, 0);
+}
+
 /*
  * These are the pthreads-aware version of matmul[_qt] that splits each run into
- * tc parts and queues them up for the threads to handle concurrently
+ * many small chunks of rows, dealt out to the threads and the session thread
+ * itself, and queues them up for the threads to handle concurrently
  */
 
 int
 session_matmul(txf_session_state_t *tss, float *xout, const float *x,
 	       const float *w1, int n, int d)
 {
-	unsigned int m, part = 0;
+	job_t j;
 
 #if defined(LOG_MATRIX_MUL)
 	char log[256];
@@ -140,36 +542,17 @@ session_matmul(txf_session_state_t *tss, float *xout, const float *x,
 
 #endif
 
-	clamma_mutex_lock(&work.mut_job);
-
-	for (m = 0; m < count_threads; m++) {
-		job_t *j = &work.job_ring[work.job_head];
-
-		j->tss	= tss;
-		j->type = CLAMMA_JOB_MATMUL;
-		j->xout	= xout;
-		j->x	= x;
-		j->w1	= w1;
-		j->i	= part;
-		j->n	= n;
-		j->d	= d;
-		j->dlim	= m == count_threads - 1 ? (unsigned int)d :
-						   part + (d / count_threads);
-
-		part += d / count_threads;
-		work.job_head = (work.job_head + 1) %
-					CLAMMA_ARRAY_SIZE(work.job_ring);
-		/* the job ring needs to be bigger */
-		assert(work.job_head != work.job_tail);
-		tss->queued++;
-		/* the job ring needs to be bigger */
-		assert(tss->queued < (int)CLAMMA_ARRAY_SIZE(work.job_ring));
-	}
-
-	clamma_mutex_unlock(&work.mut_job);
+	memset(&j, 0, sizeof(j));
+	j.tss	= tss;
+	j.type	= CLAMMA_JOB_MATMUL;
+	j.xout	= xout;
+	j.x	= x;
+	j.w1	= w1;
+	j.n	= n;
+	j.d	= d;
 
-	for (m = 0; m < count_threads; m++)
-		clamma_sem_post(&work_threads[m].sem_start);
+	job_queue(&j, job_split(&j, d, CLAMMA_JOB_CHUNKS_PER_PART,
+				CLAMMA_JOB_MIN_ROWS, 1));
 
 	return 0;
 }
@@ -178,34 +561,116 @@ int
 session_matmul_qt(txf_session_state_t *tss, float *xout, const qt_t *x,
 		 const qt_t *w1, int n, int d)
 {
-	unsigned int m, part = 0;
+	job_t j;
+
+	memset(&j, 0, sizeof(j));
+	j.tss	= tss;
+	j.type	= CLAMMA_JOB_MATMUL_QT;
+	j.xout	= xout;
+	j.qt_x	= x;
+	j.qt_w	= w1;
+	j.n	= n;
+	j.d	= d;
+
+	job_queue(&j, job_split(&j, d, CLAMMA_JOB_CHUNKS_PER_PART,
+				CLAMMA_JOB_MIN_ROWS, 1));
+
+	return 0;
+}
+
+/*
+ * Batch tokenizer jobs are split down to single documents if need be, since
+ * documents vary in length and the threads steal them as they become free
+ */
+
+int
+session_vocab_batch(txf_session_state_t *tss, clamma_job_type_t type,
+		    vocab_batch_t *vb, size_t count)
+{
+	job_t j;
+
+	memset(&j, 0, sizeof(j));
+	j.tss	= tss;
+	j.type	= type;
+	j.vb	= vb;
+
+	job_queue(&j, job_split(&j, (int)count, 4, 1, 1));
+
+	return 0;
+}
+
+/*
+ * Split faulting in a range of the model image across the threads, in page
+ * multiples
+ */
+
+int
+session_prefault(txf_session_state_t *tss, const uint8_t *p, size_t len)
+{
+	job_t j;
+
+	memset(&j, 0, sizeof(j));
+	j.tss	= tss;
+	j.type	= CLAMMA_JOB_PREFAULT;
+	j.mem	= p;
+
+	job_queue(&j, job_split(&j, (int)len, 4, 4096, 4096));
+
+	return 0;
+}
+
+/*
+ * Is an op queued on tss's pool after op k with chunks nobody has taken yet?
+ * Workers idling in k's graph leave it for those, so with several stepping
+ * threads one session's graph doesn't keep the workers from the others' ops.
+ */
 
-	clamma_mutex_lock(&work.mut_job);
+int
+clamma_smp_ops_waiting(const txf_session_state_t *tss, unsigned long k)
+{
+	const work_t *wk = &tss->pool->work;
+	unsigned long head = (unsigned long)clamma_atomic_load(&wk->job_head),
+		      i;
+	unsigned int m;
 
-	for (m = 0; m < count_threads; m++) {
-		job_t *j = &work.job_ring[work.job_head];
+	for (i = k + 1; i < head &&
+			i < k + CLAMMA_ARRAY_SIZE(wk->job_ring); i++) {
+		const job_t *j = &wk->job_ring[i %
+					CLAMMA_ARRAY_SIZE(wk->job_ring)];
 
-		j->tss	= tss;
-		j->type = CLAMMA_JOB_MATMUL_QT;
-		j->xout	= xout;
-		j->qt_x	= x;
-		j->qt_w	= w1;
-		j->i	= part;
-		j->n	= n;
-		j->d	= d;
-		j->dlim	= m == count_threads - 1 ? (unsigned int)d :
-					part + (d / count_threads);
+		/* parts of ops that used the slot before have other gens */
 
-		part += d / count_threads;
-		work.job_head = (work.job_head + 1) %
-					CLAMMA_ARRAY_SIZE(work.job_ring);
-		tss->queued++;
+		for (m = 0; m < CLAMMA_JOB_MAX_PARTS; m++) {
+			uint64_t v = (uint64_t)clamma_atomic_load64(&j->part[m]);
+
+			if ((uint32_t)(v >> 32) == (uint32_t)(i + 1) &&
+			    (v & 0xffff) < ((v >> 16) & 0xffff))
+				return 1;
+		}
 	}
 
-	clamma_mutex_unlock(&work.mut_job);
+	return 0;
+}
+
+/*
+ * Run the session's layer graph on the pool.  The chunks are just tickets to
+ * join in, one per part, so any free worker takes nodes as they become ready
+ * until there are none for it for a while.  The session thread's ticket keeps
+ * it in until the whole graph is done.
+ */
+
+int
+session_graph(txf_session_state_t *tss)
+{
+	job_t j;
+
+	memset(&j, 0, sizeof(j));
+	j.tss	= tss;
+	j.type	= CLAMMA_JOB_GRAPH;
+	j.chunk	= 1;
+	j.end	= (int)job_nparts(tss->pool);
 
-	for (m = 0; m < count_threads; m++)
-		clamma_sem_post(&work_threads[m].sem_start);
+	job_queue(&j, (unsigned int)j.end);
 
 	return 0;
 }
@@ -26,12 +26,37 @@
 
 #include "private.h"
 
+#if !defined(_WIN32)
+#include <sys/stat.h>
+#endif
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
 static txf_t		*txf_head;
 static txf_session_t	*sess_head;
 #if defined(LIBCLAMMA_SMP)
 clamma_mutex_t          mut_sessions;
+clamma_sem_t            sem_sessions;
+static unsigned int	sess_waiters; /* on sem_sessions, under mut_sessions */
 #endif
 
+/*
+ * A session was let go, went idle or away, so wake the stepping threads that
+ * found all the others taken.  Call with mut_sessions held.
+ */
+
+static void
+sessions_wake(void)
+{
+#if defined(LIBCLAMMA_SMP)
+	while (sess_waiters) {
+		sess_waiters--;
+		clamma_sem_post(&sem_sessions);
+	}
+#endif
+}
+
 static void
 dequantize(txf_t *t, qt_t *qx, float *x, int n)
 {
@@ -39,8 +64,12 @@ dequantize(txf_t *t, qt_t *qx, float *x, int n)
 	const float *w_s = clamma_weight_cache(t, qx->s,
 				(n / t->c.group_size) * sizeof(*w_s));
 
-	for (int i = 0; i < n; i++)
-		x[i] = (float)w_q[i] * w_s[i / t->c.group_size];
+	if (w_q && w_s)
+		for (int i = 0; i < n; i++)
+			x[i] = (float)w_q[i] * w_s[i / t->c.group_size];
+
+	clamma_weight_cache_release(t, w_q);
+	clamma_weight_cache_release(t, w_s);
 }
 
 static qt_t *
@@ -64,6 +93,623 @@ init_quantized_tensors(txf_t *t, void **ptr, int n, int size_each)
 	return res;
 }
 
+/*
+ * MMAP mode page cache hints.  The matmuls scan each layer tensor from end to
+ * end, so those want sequential readahead, but the float token embeddings
+ * are only read a row at a time.
+ */
+
+static void
+mmap_advise_range(const void *p, size_t len, int advice)
+{
+#if !defined(_WIN32)
+	static uintptr_t ps;
+	uintptr_t a;
+
+	if (!ps)
+		ps = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+	a = (uintptr_t)p & ~(ps - 1);
+	madvise((void *)a, len + ((uintptr_t)p - a), advice);
+#else
+	(void)p;
+	(void)len;
+	(void)advice;
+#endif
+}
+
+static void
+mmap_advise(const txf_t *t)
+{
+#if !defined(_WIN32)
+	clamma_wref_t w[CLAMMA_LAYER_WEIGHTS_MAX];
+	unsigned int l, n, c;
+
+	if (t->c.version == CLAMMA_MODEL_VERSION1_FLOAT &&
+	    !t->c.shared_classifier)
+		mmap_advise_range(t->w.token_embedding_table,
+				  (size_t)t->c.vocab_size * t->c.dim *
+							sizeof(float),
+				  MADV_RANDOM);
+
+	for (l = 0; l <= t->c.n_layers; l++) {
+		c = clamma_layer_weights(t, l, w);
+		for (n = 0; n < c; n++)
+			mmap_advise_range(w[n].p, w[n].len, MADV_SEQUENTIAL);
+	}
+#else
+	(void)t;
+#endif
+}
+
+/*
+ * Start reading layer l in from the model file, if it's not already in the
+ * page cache, so the matmuls don't take the major faults one page at a time
+ */
+
+void
+clamma_mmap_willneed(const txf_t *t, unsigned int l)
+{
+	clamma_wref_t w[CLAMMA_LAYER_WEIGHTS_MAX];
+	unsigned int n, c;
+
+	if (t->huge || t->shm) /* already all in memory */
+		return;
+
+	c = clamma_layer_weights(t, l, w);
+	for (n = 0; n < c; n++)
+		mmap_advise_range(w[n].p, w[n].len, MADV_WILLNEED);
+}
+
+#if defined(__linux__)
+
+/* how much of the mapping starting at p the kernel backed with THP */
+
+static uint64_t
+smaps_anon_huge(const void *p)
+{
+	char line[256], start[32];
+	uint64_t kb = 0;
+	int in = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return 0;
+
+	snprintf(start, sizeof(start), "%lx-", (unsigned long)(uintptr_t)p);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (!in) {
+			in = !strncmp(line, start, strlen(start));
+			continue;
+		}
+		if (sscanf(line, "AnonHugePages: %llu kB",
+			   (unsigned long long *)&kb) == 1)
+			break;
+	}
+
+	fclose(f);
+
+	return kb * 1024;
+}
+
+#endif
+
+static void
+qt_rebase(qt_t *q, unsigned int n, ptrdiff_t delta)
+{
+	while (n--) {
+		q->q = (cq_t *)((uint8_t *)q->q + delta);
+		q->s = (float *)((uint8_t *)q->s + delta);
+		q++;
+	}
+}
+
+/* move all the weight pointers into the model image by d bytes */
+
+static void
+txf_rebase(txf_t *t, ptrdiff_t d)
+{
+	unsigned int nl = t->c.n_layers;
+
+	switch (t->c.version) {
+	case CLAMMA_MODEL_VERSION1_FLOAT:
+		/* everything, including wcls, points into the image */
+		t->w.token_embedding_table = (float *)
+				((uint8_t *)t->w.token_embedding_table + d);
+		t->w.wq = (qt_t *)((uint8_t *)t->w.wq + d);
+		t->w.wk = (qt_t *)((uint8_t *)t->w.wk + d);
+		t->w.wv = (qt_t *)((uint8_t *)t->w.wv + d);
+		t->w.wo = (qt_t *)((uint8_t *)t->w.wo + d);
+		t->w.w1 = (qt_t *)((uint8_t *)t->w.w1 + d);
+		t->w.w2 = (qt_t *)((uint8_t *)t->w.w2 + d);
+		t->w.w3 = (qt_t *)((uint8_t *)t->w.w3 + d);
+		t->w.wcls = (qt_t *)((uint8_t *)t->w.wcls + d);
+		break;
+	default:
+		/* the qt_t are on the heap, what they point to isn't */
+		qt_rebase(t->w.q_tokens, 1, d);
+		qt_rebase(t->w.wq, nl, d);
+		qt_rebase(t->w.wk, nl, d);
+		qt_rebase(t->w.wv, nl, d);
+		qt_rebase(t->w.wo, nl, d);
+		qt_rebase(t->w.w1, nl, d);
+		qt_rebase(t->w.w2, nl, d);
+		qt_rebase(t->w.w3, nl, d);
+		if (!t->c.shared_classifier)
+			qt_rebase(t->w.wcls, 1, d);
+		break;
+	}
+
+	t->w.rms_att_weight = (float *)((uint8_t *)t->w.rms_att_weight + d);
+	t->w.rms_ffn_weight = (float *)((uint8_t *)t->w.rms_ffn_weight + d);
+	t->w.rms_final_weight = (float *)
+				((uint8_t *)t->w.rms_final_weight + d);
+}
+
+/* where the model image the weights point into is now */
+
+static const uint8_t *
+model_image(const txf_t *t)
+{
+	if (t->shm)
+		return t->shm + CLAMMA_SHM_HDR;
+	if (t->huge)
+		return (const uint8_t *)t->huge;
+
+	return (const uint8_t *)t->data;
+}
+
+/*
+ * MMAP mode: move the weights onto 2MB pages, so the matmuls scanning them
+ * aren't limited by the reach of the 4KB dTLB.  The model image is copied to
+ * 2MB aligned anonymous memory, from the reserved hugetlbfs pool if hugetlb
+ * is set and it has room, otherwise advised for transparent hugepages, and
+ * the weight pointers are moved over to the copy.  If nothing can be
+ * allocated, the model is left reading from the file mapping.
+ */
+
+int
+clamma_txf_hugepages(txf_t *t, int hugetlb)
+{
+#if defined(__linux__)
+	size_t hp = CLAMMA_CWA_CHUNK, len;
+	uint64_t got;
+	uint8_t *p;
+
+	/* replicas would be left copies of the old image */
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MMAP || t->huge ||
+	    t->numa_len || t->shm)
+		return 1;
+
+	len = ((size_t)t->file_size + hp - 1) & ~(hp - 1);
+	p = MAP_FAILED;
+
+#if defined(MAP_HUGETLB)
+	if (hugetlb) {
+		p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+			 MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED)
+			fprintf(stderr, "%s: %s: no %uMB hugetlbfs pages, "
+				"using THP\n", __func__, t->name,
+				(unsigned int)(len / (1024 * 1024)));
+	}
+#endif
+	if (p == MAP_FAILED) {
+		p = clamma_huge_map(len);
+		if (!p) {
+			fprintf(stderr, "%s: %s: OOM\n", __func__, t->name);
+			return 1;
+		}
+	} else
+		t->huge_tlb = 1;
+
+	memcpy(p, t->data, (size_t)t->file_size);
+	txf_rebase(t, p - (uint8_t *)t->data);
+
+	t->huge = p;
+	t->huge_len = len;
+
+	/* our view of the file isn't needed any more */
+	madvise(t->data, (size_t)t->file_size, MADV_DONTNEED);
+
+	got = t->huge_tlb ? len : smaps_anon_huge(p);
+	fprintf(stderr, "%s: %s: %uMB image on %s, %llu / %llu hugepages\n",
+		__func__, t->name, (unsigned int)(len / (1024 * 1024)),
+		t->huge_tlb ? "hugetlbfs" : "THP",
+		(unsigned long long)(got / hp),
+		(unsigned long long)(len / hp));
+
+	return 0;
+#else
+	(void)t;
+	(void)hugetlb;
+
+	return 1;
+#endif
+}
+
+/*
+ * Fault in p .. p + len for reading.  MADV_POPULATE_READ does it in one call
+ * where the kernel has it (5.14+), otherwise read a byte from each page.
+ */
+
+void
+clamma_prefault_run(const uint8_t *p, size_t len)
+{
+	const volatile uint8_t *b = p;
+	uint8_t sum = 0;
+	size_t n;
+
+#if defined(MADV_POPULATE_READ)
+	uintptr_t a = (uintptr_t)p & ~(uintptr_t)4095;
+
+	if (!madvise((void *)a, len + ((uintptr_t)p - a), MADV_POPULATE_READ))
+		return;
+#endif
+
+	for (n = 0; n < len; n += 4096)
+		sum ^= b[n];
+	if (len)
+		sum ^= b[len - 1];
+	(void)sum;
+}
+
+#define CLAMMA_PREFAULT_STEP (64 * 1024 * 1024)
+
+/*
+ * Fault the whole model image in at startup using the worker threads, so the
+ * first queries after a deploy aren't paced by major faults.  If lock is set,
+ * the image is also mlock()ed so page cache pressure can't evict it later,
+ * this needs RLIMIT_MEMLOCK to allow it.  Progress is logged every 10%.
+ *
+ * MMAP and ABSOLUTE_ADDRESS modes only, MALLOC_CACHE weights aren't in
+ * memory until the cache loads them.
+ */
+
+int
+clamma_txf_prefault(txf_t *t, int lock)
+{
+	uint64_t start = clamma_timestamp_ns(), el;
+	size_t len = (size_t)t->file_size, done = 0, n;
+	unsigned int pc = 0;
+	const uint8_t *p;
+#if defined(LIBCLAMMA_SMP)
+	txf_session_state_t tss;
+	int smp = t->pool && t->pool->count > 1;
+#endif
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE && !t->shm) {
+		fprintf(stderr, "%s: %s: not supported in MALLOC_CACHE mode\n",
+				__func__, t->name);
+		return 1;
+	}
+
+#if defined(LIBCLAMMA_SMP)
+	memset(&tss, 0, sizeof(tss));
+	if (smp && clamma_smp_tss_init(&tss, t->pool))
+		smp = 0;
+#endif
+
+	p = model_image(t);
+
+	while (done < len) {
+		n = len - done;
+		if (n > CLAMMA_PREFAULT_STEP)
+			n = CLAMMA_PREFAULT_STEP;
+
+#if defined(LIBCLAMMA_SMP)
+		if (smp) {
+			session_prefault(&tss, p + done, n);
+			clamma_smp_sync_point(&tss);
+		} else
+#endif
+			clamma_prefault_run(p + done, n);
+
+		done += n;
+		if ((done * 10) / len != pc) {
+			pc = (unsigned int)((done * 10) / len);
+			fprintf(stderr, "%s: %s: %u%% (%uMB / %uMB)\n",
+				__func__, t->name, pc * 10,
+				(unsigned int)(done / (1024 * 1024)),
+				(unsigned int)(len / (1024 * 1024)));
+		}
+	}
+
+#if defined(LIBCLAMMA_SMP)
+	if (smp)
+		clamma_smp_tss_deinit(&tss);
+#endif
+
+	el = clamma_timestamp_ns() - start;
+	fprintf(stderr, "%s: %s: %uMB in %ums (%.0fMB/s)\n", __func__,
+		t->name, (unsigned int)(len / (1024 * 1024)),
+		(unsigned int)(el / 1000000),
+		el ? ((double)len / (1024 * 1024)) /
+				((double)el / 1000000000.0) : 0.0);
+
+	if (!lock || t->locked)
+		return 0;
+
+#if defined(_WIN32)
+	if (!VirtualLock((LPVOID)p, len)) {
+#else
+	if (mlock(p, len)) {
+#endif
+		fprintf(stderr, "%s: %s: unable to lock %uMB: %d (check "
+				"RLIMIT_MEMLOCK)\n", __func__, t->name,
+				(unsigned int)(len / (1024 * 1024)), errno);
+		return 1;
+	}
+
+	t->locked = 1;
+
+	return 0;
+}
+
+#if defined(LIBCLAMMA_SMP) && defined(__linux__) && defined(SYS_mbind)
+#define CLAMMA_MPOL_PREFERRED 1 /* allocate on the node if it has room */
+#endif
+
+/*
+ * On a multi-node machine, give each NUMA node's workers their own copy of
+ * the model image, placed in that node's memory, so the matmuls aren't
+ * reading half their weights across the interconnect.  It costs a copy of the
+ * image per node.  If using clamma_txf_hugepages(), call that first; the
+ * replicas are on THP anyway.  On a single node, there's nothing to do.
+ */
+
+int
+clamma_txf_numa_replicate(txf_t *t)
+{
+#if defined(CLAMMA_MPOL_PREFERRED)
+	unsigned long mask[1024 / (8 * sizeof(unsigned long))];
+	size_t len = (size_t)t->file_size, ml;
+	const uint8_t *base;
+	unsigned int n, bpl = 8 * sizeof(unsigned long);
+	uint8_t *p;
+
+	if (numa_nodes < 2 || t->numa_len)
+		return 0;
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE && !t->shm) {
+		fprintf(stderr, "%s: %s: not supported in MALLOC_CACHE mode\n",
+				__func__, t->name);
+		return 1;
+	}
+
+	base = model_image(t);
+	ml = (len + CLAMMA_CWA_CHUNK - 1) & ~(size_t)(CLAMMA_CWA_CHUNK - 1);
+
+	for (n = 0; n < numa_nodes; n++) {
+		p = clamma_huge_map(ml);
+		if (!p)
+			break;
+
+		/* the policy must be set before the pages are touched */
+		memset(mask, 0, sizeof(mask));
+		mask[numa_node_id[n] / bpl] |= 1ul << (numa_node_id[n] % bpl);
+		if (syscall(SYS_mbind, p, ml, CLAMMA_MPOL_PREFERRED, mask,
+			    (unsigned long)(sizeof(mask) * 8), 0)) {
+			clamma_huge_unmap(p, ml);
+			break;
+		}
+
+		memcpy(p, base, len);
+		t->numa_copy[n] = p;
+	}
+
+	if (!n) {
+		fprintf(stderr, "%s: %s: unable to replicate: %d\n",
+				__func__, t->name, errno);
+		return 1;
+	}
+
+	/* workers on nodes without a copy read the original */
+	t->numa_base = base;
+	t->numa_len = len;
+
+	fprintf(stderr, "%s: %s: %uMB image on %u / %u nodes\n", __func__,
+			t->name, (unsigned int)(len / (1024 * 1024)), n,
+			numa_nodes);
+
+	return n != numa_nodes;
+#else
+	(void)t;
+
+	return 0;
+#endif
+}
+
+/*
+ * Cross-process sharing: one loader process publishes the model image, and
+ * any tables derived from it, into a named POSIX shm segment, then other
+ * processes loading the same model attach to it read-only.  Their weights,
+ * including the int8 dequantized embeddings and, in MALLOC_CACHE mode, what
+ * would have been the cached weights, then cost them nothing private.
+ *
+ * Publishing replaces any previous segment of that name; processes already
+ * attached keep the old one until they destroy the model.  The segment
+ * persists after the publisher exits, until shm_unlink().
+ */
+
+int
+clamma_txf_shared_publish(const txf_t *t, const char *name)
+{
+#if !defined(_WIN32)
+	size_t fs = (size_t)t->file_size, il = (fs + 4095) & ~(size_t)4095,
+	       el = 0, len, o, n;
+	clamma_shm_hdr_t *h;
+	uint8_t *p;
+	int fd;
+
+	if (t->c.version == CLAMMA_MODEL_VERSION2_INT8_80)
+		el = (size_t)t->c.vocab_size * t->c.dim * sizeof(float);
+	len = CLAMMA_SHM_HDR + il + el;
+
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0444);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: unable to create %s: %d\n",
+				__func__, t->name, name, errno);
+		return 1;
+	}
+
+	if (ftruncate(fd, (off_t)len))
+		goto bail;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		goto bail;
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE && !t->shm) {
+		/* aligned steps, in case the fd is O_DIRECT */
+		for (o = 0; o < il; o += n) {
+			n = il - o;
+			if (n > CLAMMA_PREFAULT_STEP)
+				n = CLAMMA_PREFAULT_STEP;
+			if (clamma_model_read(t, p + CLAMMA_SHM_HDR + o, n,
+					      n < fs - o ? n : fs - o, o))
+				goto bail1;
+		}
+	} else
+		memcpy(p + CLAMMA_SHM_HDR, model_image(t), fs);
+
+	h = (clamma_shm_hdr_t *)p;
+	h->file_size = fs;
+	h->c = t->c;
+	if (el) {
+		h->emb_ofs = CLAMMA_SHM_HDR + il;
+		memcpy(p + h->emb_ofs, t->w.token_embedding_table, el);
+	}
+
+	/* attachers ignore it until this is set */
+	clamma_atomic_store(&h->ready, CLAMMA_SHM_MAGIC);
+
+	munmap(p, len);
+	close(fd);
+
+	fprintf(stderr, "%s: %s: %uMB as %s\n", __func__, t->name,
+			(unsigned int)(len / (1024 * 1024)), name);
+
+	return 0;
+
+bail1:
+	munmap(p, len);
+bail:
+	fprintf(stderr, "%s: %s: unable to fill %s: %d\n", __func__, t->name,
+			name, errno);
+	close(fd);
+	shm_unlink(name);
+
+	return 1;
+#else
+	(void)t;
+	(void)name;
+
+	return 1;
+#endif
+}
+
+/*
+ * Switch t over to the weights in the named segment, if it's complete and
+ * was published from the same model.  It has to be done before
+ * clamma_txf_hugepages(), clamma_txf_numa_replicate() or weight streaming.
+ */
+
+int
+clamma_txf_shared_attach(txf_t *t, const char *name)
+{
+#if !defined(_WIN32)
+	const clamma_shm_hdr_t *h;
+	struct stat st;
+	uint8_t *p;
+	int fd;
+
+	if (t->shm || t->huge || t->numa_len || t->stream)
+		return 1;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s: unable to open %s: %d\n",
+				__func__, t->name, name, errno);
+		return 1;
+	}
+
+	if (fstat(fd, &st) || (size_t)st.st_size < CLAMMA_SHM_HDR) {
+		close(fd);
+		return 1;
+	}
+
+	p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return 1;
+
+	h = (const clamma_shm_hdr_t *)p;
+	if (clamma_atomic_load(&h->ready) != CLAMMA_SHM_MAGIC ||
+	    h->file_size != (uint64_t)t->file_size ||
+	    memcmp(&h->c, &t->c, sizeof(t->c)) ||
+	    CLAMMA_SHM_HDR + h->file_size > (uint64_t)st.st_size ||
+	    (h->emb_ofs && h->emb_ofs + (uint64_t)t->c.vocab_size *
+				t->c.dim * sizeof(float) >
+						(uint64_t)st.st_size)) {
+		fprintf(stderr, "%s: %s: %s is incomplete or a different "
+				"model\n", __func__, t->name, name);
+		munmap(p, (size_t)st.st_size);
+		return 1;
+	}
+
+	/*
+	 * In MALLOC_CACHE mode t->data is NULL, so the weights are offsets
+	 * into the file
+	 */
+	txf_rebase(t, (ptrdiff_t)((uintptr_t)(p + CLAMMA_SHM_HDR) -
+				  (uintptr_t)t->data));
+
+	if (h->emb_ofs) {
+		free(t->w.token_embedding_table);
+		t->w.token_embedding_table = (float *)(p + h->emb_ofs);
+	}
+
+	t->shm = p;
+	t->shm_len = (size_t)st.st_size;
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MMAP)
+		/* our view of the file isn't needed any more */
+		madvise(t->data, (size_t)t->file_size, MADV_DONTNEED);
+
+	fprintf(stderr, "%s: %s: attached %s\n", __func__, t->name, name);
+
+	return 0;
+#else
+	(void)t;
+	(void)name;
+
+	return 1;
+#endif
+}
+
+/*
+ * Major faults taken by the whole process so far.  Not RUSAGE_THREAD, since
+ * the pool's workers fault in most of the weights for us, but it means other
+ * sessions' and the host's faults land in the same window.
+ */
+
+static uint64_t
+majflt(void)
+{
+#if !defined(_WIN32)
+	struct rusage ru;
+
+	if (!getrusage(RUSAGE_SELF, &ru))
+		return (uint64_t)ru.ru_majflt;
+#endif
+
+	return 0;
+}
+
 static int
 def_iss_cb(void *opaque_user_pointer, const char *piece)
 {
@@ -90,37 +736,71 @@ clamma_txf_by_name(const char *name)
 	return NULL;
 }
 
+/*
+ * A session is one block holding the session object and all its buffers,
+ * each starting 64-byte aligned.  With b NULL, this just sizes it.
+ */
+
+#define SESS_CARVE(_dst, _type, _count) { \
+		if (b) \
+			_dst = (_type *)(b + o); \
+		o = (o + (size_t)(_count) * sizeof(_type) + 63) & \
+							~(size_t)63; }
+
+static size_t
+session_layout(const txf_t *t, uint8_t *b)
+{
+	size_t kvd = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads, o = 0;
+	txf_session_t *ts = (txf_session_t *)b;
+	size_t kv = (size_t)t->c.n_layers * t->c.seq_len * kvd;
+
+	o = (sizeof(*ts) + 63) & ~(size_t)63;
+
+	SESS_CARVE(ts->sampler.probindex, pidx_t, t->c.vocab_size);
+	SESS_CARVE(ts->s.x,		float, t->c.dim);
+	SESS_CARVE(ts->s.key_cache,	float, kv);
+	SESS_CARVE(ts->s.value_cache,	float, kv);
+	SESS_CARVE(ts->s.logits,	float, t->c.vocab_size);
+	SESS_CARVE(ts->s.tss.xb,	float, t->c.dim);
+	SESS_CARVE(ts->s.tss.xb2,	float, t->c.dim);
+	SESS_CARVE(ts->s.tss.hb,	float, t->c.hidden_dim);
+	SESS_CARVE(ts->s.tss.hb2,	float, t->c.hidden_dim);
+	SESS_CARVE(ts->s.tss.q,		float, t->c.dim);
+	SESS_CARVE(ts->s.tss.xq.q,	cq_t, t->c.dim);
+	SESS_CARVE(ts->s.tss.xq.s,	float, t->c.dim);
+	SESS_CARVE(ts->s.tss.hq.q,	cq_t, t->c.hidden_dim);
+	SESS_CARVE(ts->s.tss.hq.s,	float, t->c.hidden_dim);
+	SESS_CARVE(ts->s.tss.att,	float, (size_t)t->c.n_heads *
+							t->c.seq_len);
+	SESS_CARVE(ts->s.g.pending,	clamma_atomic_t, t->graph.nnodes);
+	SESS_CARVE(ts->s.g.ready,	clamma_atomic_t, t->graph.nnodes);
+
+	return o;
+}
+
 size_t
 clamma_txf_session_size(const txf_t *t)
 {
-	size_t kvd  = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
-	size_t size = (((t->c.dim       * 2) +
-		(t->c.vocab_size) +
-		(t->c.n_layers   * t->c.seq_len * kvd * 2) +
-		(t->c.n_layers    * t->c.seq_len)) * sizeof(txi_t));
-
-	switch (t->c.version) {
-	case CLAMMA_MODEL_VERSION2_INT8_80:
-		size += sizeof(txi_t) * (t->c.vocab_size +
-					 t->c.dim + t->c.dim +
-					 t->c.hidden_dim);
-		break;
-	}
+	return session_layout(t, NULL);
+}
 
-	size += 1 * sizeof(float) *
-		((t->c.dim * 5) + (t->c.hidden_dim * 4) +
-		 (t->c.n_layers * t->c.seq_len)) +
-		 (1 * (t->c.dim + t->c.hidden_dim));
+/*
+ * Session blocks are plain anonymous memory, not advised for hugepages, so
+ * the kernel faults in and zeroes only the 4KB pages a session touches
+ */
 
-	return size;
+static size_t
+session_block_len(const txf_t *t)
+{
+	return (clamma_txf_session_size(t) + 4095) & ~(size_t)4095;
 }
 
 txf_t *
 clamma_txf_construct(const clamma_txf_info_t *info)
 {
 	static const char *access_name[] = { "MMAP", "AllocCache", "Address" };
-	int head_size, threads = info->threads ? info->threads : 8;
-	char desc[256], thr[64];
+	int head_size;
+	char desc[512], thr[64], place[160];
 	uint32_t *p32 = NULL;
 	uint64_t n_layers;
 	uint8_t buf[256];
@@ -143,7 +823,14 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 
 	memset(t, 0, sizeof(*t));
 
-	clamma_smp_init(threads);
+#if defined(LIBCLAMMA_SMP)
+	/* 0 threads lets the affinity policy size the pool */
+	t->pool = clamma_pool_create(info->threads);
+	if (!t->pool) {
+		free(t);
+		return NULL;
+	}
+#endif
 
 	if (!info->checkpoint_path)
 		return t;
@@ -158,6 +845,12 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 	strncpy(t->name, info->name, sizeof(t->name));
 	t->name[sizeof(t->name) - 1] = '\0';
 
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE) {
+		if (clamma_weight_cache_init(t))
+			goto bail;
+		t->prefetch = 1;
+	}
+
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MMAP:
 	case CLAMMA_MODEL_ACCESS_MALLOC_CACHE:
@@ -233,21 +926,26 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 	head_size = t->c.dim / t->c.n_heads;
 	n_layers = t->c.n_layers;
 
+	if (clamma_graph_build(t))
+		goto bail2;
+
 	if (clamma_vocab_construct(t, info->tokenizer_path))
 		goto bail2;
+	t->v.pool = t->pool;
 
 #if defined(LIBCLAMMA_SMP)
-	snprintf(thr, sizeof(thr) - 1, "%u x ", threads);
+	snprintf(thr, sizeof(thr) - 1, "%u x ", t->pool->count);
 #else
 	thr[0] = '\0';
 #endif
+	clamma_smp_describe(t->pool, place, sizeof(place));
 
 	size = clamma_txf_session_size(t);
 	snprintf(desc, sizeof(desc) - 1,
 		       "☙ Clamma ❧  %s%s, model: %s (%uMB) %s %s, "
 			"vocab: %u (%uKB),\n"
 		       "             Session: %llu.%03lluMB, d: %u, hd: %u, "
-			"l: %u, h: %d, kvh: %d, seq_len: %d",
+			"l: %u, h: %d, kvh: %d, seq_len: %d%s%s",
 		       thr, LIBCLAMMA_THREAD_MODEL, info->checkpoint_path,
 		       (unsigned int)(t->file_size / (1024 * 1024)),
 		       t->c.version ? "int8" : "float",
@@ -256,7 +954,8 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 		       ((unsigned long long)size) / (1024 * 1024),
 		       	(((unsigned long long)size) % (1024 * 1024)) / 1000,
 		       t->c.dim, t->c.hidden_dim, t->c.n_layers, t->c.n_heads,
-		       t->c.n_kv_heads, t->c.seq_len);
+		       t->c.n_kv_heads, t->c.seq_len,
+		       place[0] ? ",\n             Threads: " : "", place);
 
 	if (info->desc && info->desc_max) {
 		strncpy(info->desc, desc, info->desc_max);
@@ -377,6 +1076,15 @@ clamma_txf_construct(const clamma_txf_info_t *info)
 		goto bail2a;
 	}
 
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MMAP)
+		mmap_advise(t);
+
+	/*
+	 * If this fails, the cache stats are just not per class, and layers
+	 * can't be pinned
+	 */
+	clamma_weight_cache_index(t);
+
 	return t;
 
 bail11:
@@ -411,7 +1119,10 @@ bail2:
 bail1:
 	close(t->fd);
 bail:
-	clamma_smp_deinit();
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE)
+		clamma_weight_cache_deinit(t);
+	clamma_graph_destroy(t);
+	clamma_pool_destroy(t->pool);
 	free(t);
 
 	return NULL;
@@ -420,10 +1131,37 @@ bail:
 void
 clamma_txf_destroy(txf_t *t)
 {
-	clamma_smp_deinit();
+	unsigned int n;
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MALLOC_CACHE) {
+		clamma_weight_cache_prefetch_cancel(t);
+		clamma_txf_weight_stream(t, 0);
+	}
+
+	clamma_pool_destroy(t->pool);
+
+	if (t->locked) /* ABSOLUTE_ADDRESS memory outlives us */
+#if defined(_WIN32)
+		VirtualUnlock((void *)model_image(t), (size_t)t->file_size);
+#else
+		munlock(model_image(t), (size_t)t->file_size);
+#endif
+
+#if !defined(_WIN32)
+	if (t->shm)
+		munmap((void *)t->shm, t->shm_len);
+#endif
+
+	for (n = 0; n < CLAMMA_NUMA_MAX; n++)
+		if (t->numa_copy[n])
+			clamma_huge_unmap(t->numa_copy[n],
+					  (t->numa_len + CLAMMA_CWA_CHUNK - 1) &
+					  ~(size_t)(CLAMMA_CWA_CHUNK - 1));
 
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MMAP:
+		if (t->huge)
+			clamma_huge_unmap(t->huge, t->huge_len);
 		if (t->data != MAP_FAILED)
 			munmap(t->data, t->file_size);
 		/* fallthru */
@@ -437,7 +1175,8 @@ clamma_txf_destroy(txf_t *t)
 
 	switch (t->model_access) {
 	case CLAMMA_MODEL_ACCESS_MALLOC_CACHE:
-		clamma_weight_cache_clear();
+		clamma_weight_cache_clear(t);
+		clamma_weight_cache_deinit(t);
 		break;
 	default:
 		break;
@@ -445,6 +1184,14 @@ clamma_txf_destroy(txf_t *t)
 
 	clamma_vocab_destroy(t);
 
+	while (t->sess_pool) {
+		void *b = t->sess_pool;
+
+		t->sess_pool = *(void **)b;
+		munmap(b, session_block_len(t));
+	}
+
+	clamma_graph_destroy(t);
 	free(t);
 }
 
@@ -458,126 +1205,228 @@ clamma_timestamp_ns(void)
 	return (time.tv_sec * 1000000000ull) + time.tv_nsec;
 }
 
-txf_session_t *
-clamma_session_construct(const txf_t *t)
+/*
+ * What a session reserving kv cache for positions costs, 0 means seq_len.
+ *
+ * Session blocks are backed by 4KB pages, so the budget charges each layer's
+ * K and V reservation rounded up to 4KB.  The regions aren't page aligned, so
+ * what's resident can still go over by up to one page per layer's K and V.
+ */
+
+size_t
+clamma_txf_session_footprint(const txf_t *t, size_t positions)
 {
-	txf_session_state_t *tss;
-	unsigned int count_sessions = 0;
-	txf_session_t *ts;
-	size_t kvd, size;
-	float *fp;
+	size_t kvd = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads,
+	       full = t->c.seq_len * kvd * sizeof(float), used;
 
-	/* limit sessions on this txf to its maximum, if any */
+	if (!positions || positions > t->c.seq_len)
+		positions = t->c.seq_len;
 
-	if (t->max_sessions) {
-#if defined(LIBCLAMMA_SMP)
-		clamma_mutex_lock(&mut_sessions);
-#endif
-		ts = sess_head;
-		while (ts) {
-			if (ts->t == t)
-				count_sessions++;
-			ts = ts->next;
-		}
-#if defined(LIBCLAMMA_SMP)
-		clamma_mutex_unlock(&mut_sessions);
-#endif
+	used = (positions * kvd * sizeof(float) + 4095) & ~(size_t)4095;
+	if (used > full)
+		used = full;
 
-		if (count_sessions >= t->max_sessions) {
-			fprintf(stderr, "%s: reached max sessions %u\n",
-					__func__, count_sessions);
+	return clamma_txf_session_size(t) - (full - used) * 2 * t->c.n_layers;
+}
 
-			return NULL;
-		}
+/*
+ * Limit the total footprint sessions on t may reserve, 0 is no limit.  It
+ * doesn't affect sessions that already exist.
+ */
+
+int
+clamma_txf_session_budget(txf_t *t, size_t bytes)
+{
+	clamma_mutex_lock(&mut_sessions);
+	t->sess_budget = bytes;
+	clamma_mutex_unlock(&mut_sessions);
+
+	return 0;
+}
+
+static const char * const admit_names[] = {
+	"ok", "max sessions", "over budget", "out of memory"
+};
+
+const char *
+clamma_admit_reason_name(clamma_admit_t r)
+{
+	if ((unsigned int)r >= CLAMMA_ARRAY_SIZE(admit_names))
+		return "?";
+
+	return admit_names[r];
+}
+
+/* call with mut_sessions held */
+
+static void
+session_unreserve(const txf_t *t, size_t fp)
+{
+	txf_t *tm = (txf_t *)t;
+
+	tm->sess_count--;
+	tm->sess_reserved -= fp;
+}
+
+/*
+ * A recycled block can still have kv cache pages resident past the positions
+ * the new session reserved, from a session that used more.  Give back the
+ * whole pages in each layer's unused K and V tail.  The page straddling the
+ * end of the reservation stays, which is the slack the footprint allows.
+ */
+
+static void
+session_kv_trim(const txf_t *t, txf_session_t *ts, size_t positions)
+{
+#if !defined(_WIN32)
+	size_t kvd = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
+	uintptr_t ps = (uintptr_t)sysconf(_SC_PAGESIZE), a, e;
+	float *base;
+	unsigned int l;
+
+	for (l = 0; l < 2 * t->c.n_layers; l++) {
+		base = (l & 1 ? ts->s.value_cache : ts->s.key_cache) +
+				(size_t)(l >> 1) * t->c.seq_len * kvd;
+		a = ((uintptr_t)(base + positions * kvd) + ps - 1) & ~(ps - 1);
+		e = (uintptr_t)(base + t->c.seq_len * kvd) & ~(ps - 1);
+		if (e > a)
+			madvise((void *)a, e - a, MADV_DONTNEED);
 	}
+#else
+	(void)t;
+	(void)ts;
+	(void)positions;
+#endif
+}
 
-	ts = malloc(sizeof(*ts));
-	if (!t)
-		return NULL;
+/*
+ * Create a session whose queries can use up to positions tokens of context
+ * (0 means seq_len), if the model's max_sessions and session budget allow
+ * it.  If reason is given, it's set to why the session was or wasn't made.
+ */
 
-	memset(ts, 0, sizeof(*ts));
+txf_session_t *
+clamma_session_construct_admit(const txf_t *t, size_t positions,
+			       clamma_admit_t *reason)
+{
+	size_t fp = clamma_txf_session_footprint(t, positions);
+	clamma_admit_t r = CLAMMA_ADMIT_OK;
+	txf_session_t *ts = NULL;
+	unsigned int count;
+	size_t reserved;
+	uint8_t *b = NULL;
+	int recycled;
 
-	ts->t = t;
+	if (!positions || positions > t->c.seq_len)
+		positions = t->c.seq_len;
 
-	// buffer only used with nucleus sampling; may not need but it's ~small
-	ts->sampler.probindex   = malloc(t->c.vocab_size * sizeof(pidx_t));
-	if (!ts->sampler.probindex)
-		goto bail1;
+	/*
+	 * Reuse a block from an earlier session if we can.  The buffers are
+	 * not cleared, the forward pass only reads what it wrote earlier at
+	 * positions below pos.
+	 */
 
-	kvd  = (t->c.dim * t->c.n_kv_heads) / t->c.n_heads;
-	size = clamma_txf_session_size(t);
+	clamma_mutex_lock(&mut_sessions);
+	if (t->max_sessions && t->sess_count >= t->max_sessions)
+		r = CLAMMA_ADMIT_MAX_SESSIONS;
+	else if (t->sess_budget && t->sess_reserved + fp > t->sess_budget)
+		r = CLAMMA_ADMIT_BUDGET;
+	else {
+		((txf_t *)t)->sess_count++;
+		((txf_t *)t)->sess_reserved += fp;
+		b = t->sess_pool;
+		if (b)
+			((txf_t *)t)->sess_pool = *(void **)b;
+	}
+	count = t->sess_count;
+	reserved = t->sess_reserved;
+	clamma_mutex_unlock(&mut_sessions);
 
-	ts->s.x = malloc(size);
-	if (!ts->s.x)
-		goto bail2;
+	if (r != CLAMMA_ADMIT_OK) {
+		fprintf(stderr, "%s: %s: %s (%u sessions, %lluKB + %lluKB "
+				"of %lluKB)\n", __func__, t->name,
+				clamma_admit_reason_name(r), count,
+				(unsigned long long)(reserved / 1024),
+				(unsigned long long)(fp / 1024),
+				(unsigned long long)(t->sess_budget / 1024));
+		goto bail;
+	}
+
+	recycled = !!b;
+	if (!b) {
+		/* fresh anonymous memory is faulted in, zeroed, on use */
+		b = mmap(NULL, session_block_len(t), PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED) {
+			b = NULL;
+			goto bail1;
+		}
+	}
 
-	memset(ts->s.x, 0, size);
-
-	fp = ts->s.x + t->c.dim;
-	ts->s.key_cache   = fp;
-	fp += t->c.n_layers * t->c.seq_len * kvd;
-	ts->s.value_cache = fp;
-	fp += t->c.n_layers * t->c.seq_len * kvd;
-	ts->s.logits      = fp;
-	tss = &ts->s.tss;
-
-	tss->t = t;
-	if (clamma_smp_tss_init(tss))
-		goto bail3;
-
-	tss->xb   = fp;
-	fp += t->c.dim;
-	tss->xb2  = fp;
-	fp += t->c.dim;
-	tss->hb   = fp;
-	fp += t->c.hidden_dim;
-	tss->hb2  = fp;
-	fp += t->c.hidden_dim;
-	tss->q    = fp;
-	fp += t->c.dim;
-
-	tss->xq.q = (cq_t *)fp;
-	fp += t->c.dim / sizeof(txi_t);
-	tss->xq.s = fp;
-	fp += t->c.dim;
-	tss->hq.q = (cq_t *)fp;
-	fp += t->c.hidden_dim / sizeof(txi_t);
-	tss->hq.s = fp;
-	fp += t->c.hidden_dim / sizeof(txi_t);
-	tss->att  = fp;
-	fp += t->c.n_heads  * t->c.seq_len;
+	ts = (txf_session_t *)b;
+	memset(ts, 0, sizeof(*ts));
+	session_layout(t, b);
+	if (recycled)
+		session_kv_trim(t, ts, positions);
+
+	ts->t = t;
+	ts->s.tss.t = t;
+	ts->kv_max = positions;
+	ts->reserved = fp;
+	ts->held = 1; /* until clamma_session_query() gives it a turn */
+	if (clamma_smp_tss_init(&ts->s.tss, t->pool))
+		goto bail1;
 
 	clamma_mutex_lock(&mut_sessions);
 	ts->next = sess_head;
 	sess_head = ts;
 	clamma_mutex_unlock(&mut_sessions);
 
-	return ts;
+	goto bail;
 
-bail3:
-	free(ts->s.x);
-bail2:
-	free(ts->sampler.probindex);
 bail1:
-	free(ts);
+	r = CLAMMA_ADMIT_NOMEM;
+	ts = NULL;
 
-	return NULL;
+	clamma_mutex_lock(&mut_sessions);
+	session_unreserve(t, fp);
+	if (b) {
+		*(void **)b = t->sess_pool;
+		((txf_t *)t)->sess_pool = b;
+	}
+	clamma_mutex_unlock(&mut_sessions);
+
+bail:
+	if (reason)
+		*reason = r;
+
+	return ts;
+}
+
+txf_session_t *
+clamma_session_construct(const txf_t *t)
+{
+	return clamma_session_construct_admit(t, 0, NULL);
 }
 
 void
 clamma_session_destroy(struct txf_session *ts)
 {
 	uint64_t ns;
+	txf_t *t;
 
 	if (!ts)
 		return;
 
 	ns = (clamma_timestamp_ns() - ts->start) / 1000000l;
 
-	fprintf(stderr, "\n%s: %p: Session: %lu tokens, tok/s: %4.03f\n",
+	fprintf(stderr, "\n%s: %p: Session: %lu tokens, tok/s: %4.03f, "
+			"process major faults: %llu (%.2f/tok)\n",
 			__func__, (void *)ts,
 			(unsigned long)ts->token_count,
-			(float)(ts->token_count * 1000ull) / (ns ? ns : 1));
+			(float)(ts->token_count * 1000ull) / (ns ? ns : 1),
+			(unsigned long long)ts->majflt,
+			(double)ts->majflt / (double)(ts->pos ? ts->pos : 1));
 
 	/* remove us from the list of sessions */
 
@@ -585,15 +1434,15 @@ clamma_session_destroy(struct txf_session *ts)
 	if (sess_head == ts)
 		sess_head = ts->next;
 	else {
-		struct txf_session *ts1 = sess_head, *ts2 = NULL;
-		while (ts1->next) {
-			ts2 = ts1;
+		struct txf_session *ts1 = sess_head;
+
+		while (ts1 && ts1->next != ts)
 			ts1 = ts1->next;
-		}
 
-		if (ts2)
-			ts2->next = ts1->next;
+		if (ts1)
+			ts1->next = ts->next;
 	}
+	sessions_wake();
 	clamma_mutex_unlock(&mut_sessions);
 
 	if (ts->null_on_destroy)
@@ -606,23 +1455,20 @@ clamma_session_destroy(struct txf_session *ts)
 		ts->tokens = NULL;
 	}
 
-	free(ts->sampler.probindex);
-	free(ts->s.x);
+	/* keep the block for the model's next session */
 
-	free(ts);
+	clamma_mutex_lock(&mut_sessions);
+	t = (txf_t *)ts->t;
+	session_unreserve(t, ts->reserved);
+	*(void **)ts = t->sess_pool;
+	t->sess_pool = ts;
+	clamma_mutex_unlock(&mut_sessions);
 }
 
-int
-clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
+static void
+session_apply_info(txf_session_t *ts, const clamma_txf_info_t *info)
 {
-	size_t limit = info->limit;
 	char desc[256];
-	size_t size;
-	int ret = 1;
-	char *total;
-
-	if (!info->limit || (uint32_t)info->limit > ts->t->c.seq_len)
-		limit = ts->t->c.seq_len;
 
 	ts->sampler.size        = ts->t->c.vocab_size;
 	ts->sampler.temperature = info->temperature >= 0.0f ? info->temperature : 0.0f;
@@ -633,29 +1479,6 @@ clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
 	ts->opaque_user_pointer = info->opaque_user_pointer;
 	ts->null_on_destroy	= info->null_on_destroy;
 
-	size = 40 + (info->prompt ? strlen(info->prompt) : 0) +
-		    (info->system ? strlen(info->system) : 0);
-	total = malloc(size);
-	if (!total)
-		goto bail;
-
-	switch (ts->t->model_type) {
-	case CLAMMA_MODEL_GEN:
-		snprintf(total, size - 1, "%s\n%s\n",
-				info->system ? info->system : "",
-				info->prompt ? info->prompt : "");
-		break;
-	case CLAMMA_MODEL_CHAT:
-		if (info->system)
-			snprintf(total, size - 1, "[INST] <<SYS>>\n%s\n<</SYS>>\n\n%s [/INST]\n",
-				info->system ? info->system : "",
-				info->prompt ? info->prompt : "");
-		else
-			snprintf(total, size - 1, "[INST] %s [/INST]\n",
-					info->prompt ? info->prompt : "");
-		break;
-	}
-
 	snprintf(desc, sizeof(desc) - 1,
 			"    Query: temp: %.02f, topp: %.02f, seed: %llu\n",
 			ts->sampler.temperature, ts->sampler.topp,
@@ -668,25 +1491,197 @@ clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
 
 	fprintf(stderr, "%s", desc);
 	fflush(stderr);
+}
+
+/*
+ * The prompt is encoded in segments split at the template pieces, so the
+ * template and system prompt encodings come from the vocab segment cache and
+ * only the user text is encoded fresh.  first is set for the first turn of a
+ * session, later turns don't repeat the system prompt.
+ */
+
+static tok_id_t *
+session_encode_turn(txf_session_t *ts, const char *system, const char *prompt,
+		    int first, size_t *n_tokens)
+{
+	const char *p = prompt ? prompt : "";
+	tok_id_t *tokens;
+	char *user = NULL;
+	vseg_t segs[6];
+	size_t ns = 0;
+
+	memset(segs, 0, sizeof(segs));
+
+	switch (ts->t->model_type) {
+	case CLAMMA_MODEL_GEN:
+		if (first) {
+			segs[ns].text = system ? system : "";
+			segs[ns++].cache = 1;
+			segs[ns].text = "\n";
+			segs[ns++].cache = 1;
+		}
+		segs[ns++].text = p;
+		segs[ns].text = "\n";
+		segs[ns++].cache = 1;
+		break;
+	case CLAMMA_MODEL_CHAT:
+		if (first && system) {
+			segs[ns].text = "[INST] <<SYS>>\n";
+			segs[ns++].cache = 1;
+			segs[ns].text = system;
+			segs[ns++].cache = 1;
+			segs[ns].text = "\n<</SYS>>\n\n";
+			segs[ns++].cache = 1;
+			segs[ns++].text = p;
+		} else {
+			/* keep the space with the user text it belongs to */
+			user = malloc(strlen(p) + 2);
+			if (!user)
+				return NULL;
+			user[0] = ' ';
+			strcpy(user + 1, p);
+
+			segs[ns].text = "[INST]";
+			segs[ns++].cache = 1;
+			segs[ns++].text = user;
+		}
+		segs[ns].text = " [/INST]\n";
+		segs[ns++].cache = 1;
+		break;
+	}
+
+	tokens = clamma_vocab_encode_segments(ts->t, segs, ns,
+			first || ts->t->model_type == CLAMMA_MODEL_CHAT, 0,
+			n_tokens);
+	free(user);
+
+	return tokens;
+}
+
+int
+clamma_session_query(txf_session_t *ts, const clamma_txf_info_t *info)
+{
+	size_t limit = info->limit;
+	int ret = 1;
+
+	if (!info->limit || (uint32_t)info->limit > ts->kv_max)
+		limit = ts->kv_max;
+
+	session_apply_info(ts, info);
 
 	if (info->prompt && info->prompt[0])
 		clamma_session_issue(ts, info->prompt);
 
-	ts->tokens = clamma_vocab_encode(ts->t, total ? total : "", 1, 0,
+	ts->tokens = session_encode_turn(ts, info->system, info->prompt, 1,
 					 &ts->ct);
-	free(total);
 	if (!ts->tokens)
 		goto bail;
 
-	ts->limit = limit ? limit : ts->t->c.seq_len;
+	ts->limit = limit ? limit : ts->kv_max;
 	ts->token = ts->tokens[0];
 	ts->pos = 0;
+	ts->tbase = 0;
 	ts->start = clamma_timestamp_ns();
 	ts->token_count = 0;
 
+	/* the stepping threads may take it now */
+	clamma_mutex_lock(&mut_sessions);
+	ts->held = 0;
+	sessions_wake();
+	clamma_mutex_unlock(&mut_sessions);
+
+	ret = 0;
+
+bail:
+	return ret;
+}
+
+/*
+ * Sessions marked persistent are not destroyed when their turn completes,
+ * they go idle keeping their kv cache so clamma_session_append() can continue
+ * the conversation from where it left off.  The user must destroy them.
+ */
+
+void
+clamma_session_persist(txf_session_t *ts, int persist)
+{
+	ts->persist = !!persist;
+}
+
+/*
+ * Continue an idle persistent session with a new user turn.  Only the new
+ * turn is encoded, and it is prefilled starting at the current pos on top of
+ * the existing kv cache.
+ */
+
+int
+clamma_session_append(txf_session_t *ts, const clamma_txf_info_t *info)
+{
+	size_t n = 0, ct = 0, limit;
+	tok_id_t *tokens, *turn;
+	int ret = 1;
+
+	if (!ts->idle) {
+		fprintf(stderr, "%s: session is not idle\n", __func__);
+		return 1;
+	}
+
+	session_apply_info(ts, info);
+
+	/*
+	 * The last turn ended when we sampled EOS, which was not fed to the
+	 * model.  For chat, close the last turn with it and open the new one
+	 * with BOS, as in <s>[INST] q1 [/INST] a1 </s><s>[INST] q2 [/INST]
+	 */
+
+	turn = session_encode_turn(ts, NULL, info->prompt, 0, &n);
+	if (!turn)
+		return 1;
+
+	tokens = malloc((n + 1) * sizeof(*tokens));
+	if (!tokens)
+		goto bail;
+
+	if (ts->t->model_type == CLAMMA_MODEL_CHAT)
+		tokens[ct++] = TOK_EOS;
+	memcpy(tokens + ct, turn, n * sizeof(*tokens));
+	ct += n;
+
+	if (!ct || ts->pos + ct >= ts->kv_max) {
+		fprintf(stderr, "%s: context full (pos %llu + %llu)\n",
+				__func__, (unsigned long long)ts->pos,
+				(unsigned long long)ct);
+		free(tokens);
+		goto bail;
+	}
+
+	limit = ts->pos + (info->limit ? info->limit : ts->kv_max);
+	if (limit > ts->kv_max)
+		limit = ts->kv_max;
+
+	if (info->prompt && info->prompt[0])
+		clamma_session_issue(ts, info->prompt);
+
+	if (ts->tokens)
+		free(ts->tokens);
+
+	ts->tokens = tokens;
+	ts->tbase = ts->pos;
+	ts->ct = ts->pos + ct;
+	ts->limit = limit;
+	ts->token = tokens[0];
+	ts->client_gone = 0;
+
+	clamma_mutex_lock(&mut_sessions);
+	ts->idle = 0;
+	sessions_wake();
+	clamma_mutex_unlock(&mut_sessions);
+
 	ret = 0;
 
 bail:
+	free(turn);
+
 	return ret;
 }
 
@@ -696,25 +1691,83 @@ clamma_sessions_query_cancel(struct txf_session *ts)
 	ts->client_gone = 1;
 }
 
+static int
+sessions_active(void)
+{
+	txf_session_t *ts;
+
+	clamma_mutex_lock(&mut_sessions);
+	ts = sess_head;
+	while (ts && (ts->idle || (ts->held && !ts->stepping)))
+		ts = ts->next;
+	clamma_mutex_unlock(&mut_sessions);
+
+	return !!ts;
+}
+
+/*
+ * Step the session that has waited longest for a token, of the ones no other
+ * thread is stepping.  Several threads may call this at once, each then
+ * drives a different session's forward pass, the sessions' ops sharing their
+ * models' pools.  A thread finding the others have all the sessions blocks
+ * until one is let go.  Returns 0 once there are no sessions with a turn to
+ * step, sessions constructed but not queried yet don't count.
+ */
+
 int
 clamma_sessions_step_next(void)
 {
-	txf_session_t *ts, *ts1 = NULL;
+	txf_session_t *ts, **pts;
+	int busy = 0;
+
+	/*
+	 * skip any idle persistent sessions, ones being stepped and ones not
+	 * queried yet
+	 */
 
+	clamma_mutex_lock(&mut_sessions);
 	ts = sess_head;
+	while (ts && (ts->idle || ts->held)) {
+		busy |= ts->stepping;
+		ts = ts->next;
+	}
+	if (ts)
+		ts->held = ts->stepping = 1;
+#if defined(LIBCLAMMA_SMP)
+	else if (busy) {
+		/*
+		 * the other stepping threads have them all, wait for one of
+		 * them to let a session go
+		 */
+		sess_waiters++;
+		clamma_mutex_unlock(&mut_sessions);
+		clamma_sem_wait(&sem_sessions);
+
+		return 1;
+	}
+#endif
+	clamma_mutex_unlock(&mut_sessions);
+
 	if (!ts) {
 		fprintf(stderr, "no sessions\n");
 		return 0;
 	}
 
+	clamma_smp_place_caller(ts->t->pool);
+
 	if (ts->client_gone)
 		goto eol;
 
 	if (ts->pos < ts->limit) {
 		bool is_prompt = ts->pos + 1 < ts->ct;
+		/* process-wide, so only indicative */
+		uint64_t mf = majflt();
+		int turn = clamma_weight_stream_pass_begin(ts->t);
 
 		ts->tnext = clamma_session_forward(ts, is_prompt,
 						  ts->token, ts->pos++);
+		clamma_weight_stream_pass_end(ts->t, turn);
+		ts->majflt += majflt() - mf;
 
 		if (ts->pos >= ts->limit)
 			goto eol;
@@ -723,7 +1776,7 @@ clamma_sessions_step_next(void)
 			goto eol;
 
 		if (is_prompt)
-			ts->tnext = ts->tokens[ts->pos];
+			ts->tnext = ts->tokens[ts->pos - ts->tbase];
 		else {
 			if (ts->tokens) {
 				free(ts->tokens);
@@ -731,14 +1784,14 @@ clamma_sessions_step_next(void)
 			}
 		}
 
-		if (ts->tnext == TOK_BOS)
+		if (!is_prompt && ts->tnext == TOK_BOS)
 			goto eol;
 
 		ts->token_count++;
 
 		if (!is_prompt)
 			clamma_session_issue(ts,
-					 clamma_vocab_decode(ts->t,
+					 clamma_vocab_decode_r(ts->t, ts->utf8,
 						ts->token, ts->tnext));
 		if (ts->pos > 5 && ts->tnext == TOK_EOS)
 			goto eol;
@@ -746,30 +1799,27 @@ clamma_sessions_step_next(void)
 
 		ts->token = ts->tnext;
 
-		/* find the penultimate (ts1) and last (ts) entries
-		 * in the list */
+		/* let it go, at the end of the list so the others go first */
 
 		clamma_mutex_lock(&mut_sessions);
-		ts = sess_head;
-		ts1 = NULL;
-		while (ts->next) {
-			ts1 = ts;
-			ts = ts->next;
-		}
-
-		/* move the last guy to be the head */
-		if (sess_head != ts)
-			ts->next = sess_head; /* new head's next is old head */
-		sess_head = ts;
-		if (ts1)
-			ts1->next = NULL;
-
+		for (pts = &sess_head; *pts != ts; pts = &(*pts)->next)
+			;
+		*pts = ts->next;
+		while (*pts)
+			pts = &(*pts)->next;
+		*pts = ts;
+		ts->next = NULL;
+		ts->held = ts->stepping = 0;
+		sessions_wake();
 		clamma_mutex_unlock(&mut_sessions);
 
 		return 1;
 	}
 
-
+	clamma_mutex_lock(&mut_sessions);
+	ts->held = ts->stepping = 0;
+	sessions_wake();
+	clamma_mutex_unlock(&mut_sessions);
 
 	return 0;
 
@@ -778,9 +1828,25 @@ eol:
 		char eos[2] = { TOK_EOS, 0 };
 
 		clamma_session_issue(ts, eos);
+
+		if (ts->persist && !ts->client_gone) {
+			/* keep the kv cache for clamma_session_append() */
+			if (ts->tokens) {
+				free(ts->tokens);
+				ts->tokens = NULL;
+			}
+			clamma_mutex_lock(&mut_sessions);
+			ts->idle = 1;
+			ts->held = ts->stepping = 0;
+			sessions_wake();
+			clamma_mutex_unlock(&mut_sessions);
+
+			return sessions_active();
+		}
+
 		clamma_session_destroy(ts);
 
-		return !!sess_head;
+		return sessions_active();
 	}
 }
 
@@ -32,8 +32,8 @@ comp(const void *a, const void *b)
 	return strcmp(((tidx_t *)a)->str, ((tidx_t*)b)->str);
 }
 
-int
-clamma_vocab_construct(struct txf *t, const char *tokenizer_path)
+static int
+vocab_load(txf_vocab_t *v, const char *tokenizer_path, size_t vocab_size)
 {
 	char search_path[256];
 	uint32_t len;
@@ -41,15 +41,15 @@ clamma_vocab_construct(struct txf *t, const char *tokenizer_path)
 	ssize_t n;
 	int fd;
 
-	memset(&t->v, 0, sizeof(t->v));
-	t->v.size = t->c.vocab_size;
+	memset(v, 0, sizeof(*v));
+	v->size = vocab_size;
 
-	t->v.vocab = (char **)malloc(t->v.size * sizeof(char *));
-	if (!t->v.vocab)
+	v->vocab = (char **)malloc(v->size * sizeof(char *));
+	if (!v->vocab)
 		goto bail;
 
-	t->v.scores = (float *)malloc(t->v.size * sizeof(*t->v.scores));
-	if (!t->v.scores)
+	v->scores = (float *)malloc(v->size * sizeof(*v->scores));
+	if (!v->scores)
 		goto bail1;
 
 	fd = open(tokenizer_path, O_RDONLY);
@@ -63,18 +63,18 @@ clamma_vocab_construct(struct txf *t, const char *tokenizer_path)
 			goto bail2;
 		}
 	}
-	t->v.storage_size = lseek(fd, 0, SEEK_END);
+	v->storage_size = lseek(fd, 0, SEEK_END);
 	lseek(fd, 0, SEEK_SET);
 
-	n = read(fd, &t->v.max_token_length,
-		 sizeof(t->v.max_token_length));
-	if (n != (ssize_t)sizeof(t->v.max_token_length)) {
+	n = read(fd, &v->max_token_length,
+		 sizeof(v->max_token_length));
+	if (n != (ssize_t)sizeof(v->max_token_length)) {
 		fprintf(stderr, "failed read 1\n");
 		goto bail3;
 	}
 
-	for (i = 0; i < t->v.size; i++) {
-		if (read(fd, t->v.scores + i, sizeof(float)) != sizeof(float)) {
+	for (i = 0; i < v->size; i++) {
+		if (read(fd, v->scores + i, sizeof(float)) != sizeof(float)) {
 			fprintf(stderr, "failed read 2\n");
 			goto bail4;
 		}
@@ -82,64 +82,161 @@ clamma_vocab_construct(struct txf *t, const char *tokenizer_path)
 			fprintf(stderr, "failed read 3\n");
 			goto bail4;
 		}
-		t->v.vocab[i] = (char *)malloc(len + 1);
-		if (!t->v.vocab[i]) {
+		v->vocab[i] = (char *)malloc(len + 1);
+		if (!v->vocab[i]) {
 			goto bail4;
 		}
-		n = read(fd, t->v.vocab[i], len);
+		n = read(fd, v->vocab[i], len);
 		if (n != (ssize_t)len) {
 			fprintf(stderr, "failed read 4 %lld %llu\n",
 					(long long)n, (unsigned long long)len);
-			free(t->v.vocab[i]);
+			free(v->vocab[i]);
 			goto bail4;
 		}
-		t->v.vocab[i][len] = '\0';
+		v->vocab[i][len] = '\0';
 	}
 	close(fd);
 
-	t->v.sorted_vocab = malloc(t->v.size * sizeof(tidx_t));
-	if (!t->v.sorted_vocab)
+	v->sorted_vocab = malloc(v->size * sizeof(tidx_t));
+	if (!v->sorted_vocab)
 		goto bail4;
 
-	for (size_t i = 0; i < t->v.size; i++) {
-		t->v.sorted_vocab[i].str = t->v.vocab[i];
-		t->v.sorted_vocab[i].id = i;
+	for (size_t i = 0; i < v->size; i++) {
+		v->sorted_vocab[i].str = v->vocab[i];
+		v->sorted_vocab[i].id = i;
 	}
 
-	qsort(t->v.sorted_vocab, t->v.size, sizeof(tidx_t), comp);
+	qsort(v->sorted_vocab, v->size, sizeof(tidx_t), comp);
+
+	v->vsc = malloc(sizeof(*v->vsc));
+	if (!v->vsc)
+		goto bail5;
+
+	memset(v->vsc, 0, sizeof(*v->vsc));
+	v->vsc->limit = CLAMMA_VOCAB_SEGMENT_CACHE_DEFAULT;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_init(&v->vsc->mut_vsc);
+#endif
 
 	return 0;
 
+bail5:
+	free(v->sorted_vocab);
+
 bail4:
 	while (i--)
-		free(t->v.vocab[i]);
+		free(v->vocab[i]);
 
 bail3:
 	close(fd);
 bail2:
-	free(t->v.scores);
+	free(v->scores);
 bail1:
-	free(t->v.vocab);
+	free(v->vocab);
 bail:
 
 	return 1;
 }
 
+static void
+vsc_destroy(txf_vocab_t *v)
+{
+	vsc_t *e = v->vsc->lru_head, *e1;
+
+	fprintf(stderr, "    vsc: hits: %llu, misses: %llu\n",
+			(unsigned long long)v->vsc->hits,
+			(unsigned long long)v->vsc->misses);
+
+	while (e) {
+		e1 = e;
+		e = e->next;
+		free(e1);
+	}
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_destroy(&v->vsc->mut_vsc);
+#endif
+	free(v->vsc);
+	v->vsc = NULL;
+}
+
+static void
+vocab_free(txf_vocab_t *v)
+{
+	if (v->vsc)
+		vsc_destroy(v);
+
+	for (size_t i = 0; i < v->size; i++)
+		free(v->vocab[i]);
+	free(v->vocab);
+	free(v->scores);
+	free(v->sorted_vocab);
+}
+
+int
+clamma_vocab_construct(struct txf *t, const char *tokenizer_path)
+{
+	return vocab_load(&t->v, tokenizer_path, t->c.vocab_size);
+}
+
 void
 clamma_vocab_destroy(struct txf *t)
 {
-	for (size_t i = 0; i < t->v.size; i++)
-		free(t->v.vocab[i]);
-	free(t->v.vocab);
-	free(t->v.scores);
-	free(t->v.sorted_vocab);
+	vocab_free(&t->v);
 }
 
-const char *
-clamma_vocab_decode(const struct txf *t, int prev_token, int token)
+/*
+ * Tokenizer-only use, without constructing a model.  The tokenizer file
+ * doesn't record the vocab size, so the user must give it, eg, 32000 for the
+ * llama2 tokenizer.  threads is used to size the worker pool for the batch
+ * apis, if it is not already running.
+ */
+
+txf_vocab_t *
+clamma_vocab_load(const char *tokenizer_path, size_t vocab_size,
+		  unsigned int threads)
 {
-	const char *piece = t->v.vocab[token];
-	char *p = (char *)&t->v.utf8;
+	txf_vocab_t *v = malloc(sizeof(*v));
+
+	if (!v)
+		return NULL;
+
+	if (vocab_load(v, tokenizer_path, vocab_size)) {
+		free(v);
+		return NULL;
+	}
+
+#if defined(LIBCLAMMA_SMP)
+	v->pool = clamma_pool_create(threads ? threads : 8);
+	if (!v->pool) {
+		vocab_free(v);
+		free(v);
+		return NULL;
+	}
+#else
+	(void)threads;
+	v->pool = NULL;
+#endif
+
+	return v;
+}
+
+void
+clamma_vocab_unload(txf_vocab_t *v)
+{
+	if (!v)
+		return;
+
+	clamma_pool_destroy(v->pool);
+	vocab_free(v);
+	free(v);
+}
+
+static const char *
+vocab_decode(const txf_vocab_t *v, char *utf8, int prev_token, int token)
+{
+	const char *piece = v->vocab[token];
+	char *p = utf8;
 
 	if (prev_token == 1 && piece[0] == ' ')
 		piece++;
@@ -155,7 +252,7 @@ clamma_vocab_decode(const struct txf *t, int prev_token, int token)
 				return piece;
 
 			if (*piece == '>')
-				return t->v.utf8;
+				return utf8;
 
 			if (*piece >= '0' && *piece <= '9')
 				*p = (*p << 4) | ((*piece) - '0');
@@ -175,12 +272,27 @@ clamma_vocab_decode(const struct txf *t, int prev_token, int token)
 			piece++;
 		}
 
-		return t->v.utf8;
+		return utf8;
 	}
 
 	return piece;
 }
 
+const char *
+clamma_vocab_decode(const struct txf *t, int prev_token, int token)
+{
+	return vocab_decode(&t->v, (char *)&t->v.utf8, prev_token, token);
+}
+
+/* as above, but into utf8[16] of the caller's, so threads can decode at once */
+
+const char *
+clamma_vocab_decode_r(const struct txf *t, char *utf8, int prev_token,
+		      int token)
+{
+	return vocab_decode(&t->v, utf8, prev_token, token);
+}
+
 static int
 str_lookup(char *str, tidx_t *sorted_vocab, int size)
 {
@@ -190,33 +302,22 @@ str_lookup(char *str, tidx_t *sorted_vocab, int size)
 	return res ? res->id : -1;
 }
 
-tok_id_t *
-clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
-		    size_t *n_tokens)
-{
-	char *str_buffer;
-	size_t str_len = 0;
-	tok_id_t *tokens, id;
-
-	if (!text)
-		return NULL;
-
-	tokens = malloc((strlen(text) + 3) * sizeof(tokens[0]));
-	if (!tokens)
-		return NULL;
-
-	/*
-	 * create a temporary buffer that will store merge candidates of always
-	 * two consecutive tokens
-	 */
-	str_buffer = malloc(t->v.max_token_length * 2 + 1 + 2);
-	if (!str_buffer)
-		goto bail1;
+/*
+ * tokens must have room for strlen(text) + 3 entries, str_buffer for
+ * (max_token_length * 2) + 3 chars.  When text is a segment of a larger
+ * prompt, others is how many tokens of the prompt lie outside it; only
+ * whether that reaches 2 matters.
+ */
 
-	*n_tokens = 0;
+static size_t
+vocab_encode(const txf_vocab_t *v, const char *text, int8_t bos, int8_t eos,
+	     int8_t dummy, size_t others, tok_id_t *tokens, char *str_buffer)
+{
+	size_t str_len = 0, n_tokens = 0;
+	tok_id_t id;
 
 	if (bos)
-		tokens[(*n_tokens)++] = TOK_BOS;
+		tokens[n_tokens++] = TOK_BOS;
 
 	/*
 	 * add_dummy_prefix is true by default
@@ -225,10 +326,11 @@ clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
 	 * TODO: pretty sure this isn't correct in the general case but I
 	 * don't have the energy to read more of the sentencepiece code to
 	 * figure out what it's doing
+	 *
+	 * When encoding a prompt in segments, only the first one gets it.
 	 */
-	if (text[0])
-		tokens[(*n_tokens)++] =
-				str_lookup(" ", t->v.sorted_vocab, t->v.size);
+	if (dummy && text[0])
+		tokens[n_tokens++] = str_lookup(" ", v->sorted_vocab, v->size);
 
 	for (const char *c = text; *c; c++) {
 
@@ -240,9 +342,9 @@ clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
 		if ((*(c + 1) & 0xC0) == 0x80 && str_len < 4)
 			continue;
 
-		id = str_lookup(str_buffer, t->v.sorted_vocab, t->v.size);
+		id = str_lookup(str_buffer, v->sorted_vocab, v->size);
 		if (id != -1)
-			tokens[(*n_tokens)++] = id;
+			tokens[n_tokens++] = id;
 		else
 			/*
 			 * byte_fallback encoding: just encode each byte as a
@@ -251,8 +353,7 @@ clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
 			 * start at index 3
 			 */
 			for (size_t i = 0; i < str_len; i++)
-				tokens[(*n_tokens)++] =
-						(uint8_t)str_buffer[i] + 3;
+				tokens[n_tokens++] = (uint8_t)str_buffer[i] + 3;
 
 		str_len = 0;
 	}
@@ -266,13 +367,14 @@ clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
 		tok_id_t best_id = -1;
 		int best_idx = -1, id;
 
-		for (size_t i = 0; *n_tokens > 2 && i < (*n_tokens - 1); i++) {
-			sprintf(str_buffer, "%s%s", t->v.vocab[tokens[i]],
-						t->v.vocab[tokens[i + 1]]);
-			id = str_lookup(str_buffer, t->v.sorted_vocab,
-					t->v.size);
-			if (id != -1 && t->v.scores[id] > best_score) {
-				best_score = t->v.scores[id];
+		/* merging stops when the whole prompt is down to 2 tokens */
+		for (size_t i = 0; others + n_tokens > 2 && i + 1 < n_tokens;
+									i++) {
+			sprintf(str_buffer, "%s%s", v->vocab[tokens[i]],
+						v->vocab[tokens[i + 1]]);
+			id = str_lookup(str_buffer, v->sorted_vocab, v->size);
+			if (id != -1 && v->scores[id] > best_score) {
+				best_score = v->scores[id];
 				best_id = id;
 				best_idx = i;
 			}
@@ -283,20 +385,591 @@ clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
 
 		tokens[best_idx] = best_id;
 
-		for (size_t i = best_idx + 1; i < (*n_tokens - 1); i++)
+		for (size_t i = best_idx + 1; i < (n_tokens - 1); i++)
 			tokens[i] = tokens[i + 1];
 
-		(*n_tokens)--;
+		n_tokens--;
+	}
+
+	if (eos)
+		tokens[n_tokens++] = TOK_EOS;
+
+	return n_tokens;
+}
+
+tok_id_t *
+clamma_vocab_encode(const txf_t *t, const char *text, int8_t bos, int8_t eos,
+		    size_t *n_tokens)
+{
+	char *str_buffer;
+	tok_id_t *tokens;
+
+	if (!text)
+		return NULL;
+
+	tokens = malloc((strlen(text) + 3) * sizeof(tokens[0]));
+	if (!tokens)
+		return NULL;
+
+	/*
+	 * create a temporary buffer that will store merge candidates of always
+	 * two consecutive tokens
+	 */
+	str_buffer = malloc(t->v.max_token_length * 2 + 1 + 2);
+	if (!str_buffer) {
+		free(tokens);
+		return NULL;
 	}
 
+	*n_tokens = vocab_encode(&t->v, text, bos, eos, 1, 0, tokens,
+				 str_buffer);
 	free(str_buffer);
+
+	return tokens;
+}
+
+static uint64_t
+vsc_hash(const char *text, size_t len, int8_t key)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ (uint64_t)key;
+
+	while (len--) {
+		h ^= (uint8_t)*text++;
+		h *= 0x100000001b3ull;
+	}
+
+	return h;
+}
+
+static void
+vsc_unlink(vsc_state_t *sc, vsc_t *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		sc->lru_head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		sc->lru_tail = e->prev;
+}
+
+static void
+vsc_link_head(vsc_state_t *sc, vsc_t *e)
+{
+	e->prev = NULL;
+	e->next = sc->lru_head;
+	if (sc->lru_head)
+		sc->lru_head->prev = e;
+	sc->lru_head = e;
+	if (!sc->lru_tail)
+		sc->lru_tail = e;
+}
+
+static void
+vsc_evict(vsc_state_t *sc, unsigned int limit)
+{
+	while (sc->count > limit && sc->lru_tail) {
+		vsc_t *e = sc->lru_tail, **pe;
+
+		pe = &sc->hash[e->hash % CLAMMA_VOCAB_SEGMENT_CACHE_HASH];
+		while (*pe != e)
+			pe = &(*pe)->hnext;
+		*pe = e->hnext;
+
+		vsc_unlink(sc, e);
+		sc->count--;
+		free(e);
+	}
+}
+
+/*
+ * Copies the cached tokens for this segment to tokens and returns how many,
+ * or returns -1 if it's not in the cache
+ */
+
+static ssize_t
+vsc_lookup(vsc_state_t *sc, const char *text, size_t len, int8_t key,
+	   uint64_t h, tok_id_t *tokens)
+{
+	ssize_t ret = -1;
+	vsc_t *e;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&sc->mut_vsc);
+#endif
+
+	e = sc->hash[h % CLAMMA_VOCAB_SEGMENT_CACHE_HASH];
+	while (e) {
+		tok_id_t *et = (tok_id_t *)(e + 1);
+
+		if (e->hash == h && e->text_len == len && e->key == key &&
+		    !memcmp(et + e->n_tokens, text, len)) {
+			memcpy(tokens, et, e->n_tokens * sizeof(*tokens));
+			ret = (ssize_t)e->n_tokens;
+
+			/* move to the head of the lru list */
+			vsc_unlink(sc, e);
+			vsc_link_head(sc, e);
+			sc->hits++;
+			goto bail;
+		}
+		e = e->hnext;
+	}
+
+	sc->misses++;
+
+bail:
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&sc->mut_vsc);
+#endif
+
+	return ret;
+}
+
+static void
+vsc_insert(vsc_state_t *sc, const char *text, size_t len, int8_t key,
+	   uint64_t h, const tok_id_t *tokens, size_t n_tokens)
+{
+	vsc_t *e, **pe;
+
+	e = malloc(sizeof(*e) + (n_tokens * sizeof(*tokens)) + len);
+	if (!e)
+		return; /* it's just a cache */
+
+	e->hash		= h;
+	e->n_tokens	= n_tokens;
+	e->text_len	= len;
+	e->key		= key;
+	memcpy(e + 1, tokens, n_tokens * sizeof(*tokens));
+	memcpy((tok_id_t *)(e + 1) + n_tokens, text, len);
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&sc->mut_vsc);
+#endif
+
+	/* another thread may have inserted it meanwhile */
+
+	pe = &sc->hash[h % CLAMMA_VOCAB_SEGMENT_CACHE_HASH];
+	while (*pe) {
+		if ((*pe)->hash == h && (*pe)->text_len == len &&
+		    (*pe)->key == key &&
+		    !memcmp((tok_id_t *)(*pe + 1) + (*pe)->n_tokens, text, len)) {
+			free(e);
+			goto bail;
+		}
+		pe = &(*pe)->hnext;
+	}
+
+	if (sc->limit) {
+		vsc_evict(sc, sc->limit - 1);
+
+		e->hnext = sc->hash[h % CLAMMA_VOCAB_SEGMENT_CACHE_HASH];
+		sc->hash[h % CLAMMA_VOCAB_SEGMENT_CACHE_HASH] = e;
+		vsc_link_head(sc, e);
+		sc->count++;
+	} else
+		free(e);
+
+bail:
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&sc->mut_vsc);
+#endif
+}
+
+/*
+ * Encode a prompt made up of pieces, the ones marked cacheable are looked up
+ * in, or added to, the segment cache.  The sentencepiece dummy prefix is only
+ * applied to the first non-empty segment.
+ *
+ * Merges never cross segment boundaries, so the template should be split with
+ * any leading space kept at the start of the following segment.
+ */
+
+tok_id_t *
+clamma_vocab_encode_segments(const txf_t *t, const vseg_t *segs, size_t count,
+			     int8_t bos, int8_t eos, size_t *n_tokens)
+{
+	size_t n, bound = 3, len, left = 0, others;
+	int8_t dummy = 1, key;
+	char *str_buffer;
+	tok_id_t *tokens;
+	ssize_t r;
+
+	for (n = 0; n < count; n++)
+		if (segs[n].text && segs[n].text[0]) {
+			bound += strlen(segs[n].text) + 3;
+			left++;
+		}
+
+	tokens = malloc(bound * sizeof(tokens[0]));
+	if (!tokens)
+		return NULL;
+
+	str_buffer = malloc(t->v.max_token_length * 2 + 1 + 2);
+	if (!str_buffer) {
+		free(tokens);
+		return NULL;
+	}
+
+	*n_tokens = 0;
+
+	if (bos)
+		tokens[(*n_tokens)++] = TOK_BOS;
+
+	for (n = 0; n < count; n++) {
+		uint64_t h;
+
+		if (!segs[n].text || !segs[n].text[0])
+			continue;
+
+		len = strlen(segs[n].text);
+
+		/*
+		 * Each later segment adds at least one token, and merging only
+		 * cares whether the rest of the prompt comes to 2
+		 */
+		others = *n_tokens + --left;
+		if (others > 2)
+			others = 2;
+
+		if (!segs[n].cache) {
+			*n_tokens += vocab_encode(&t->v, segs[n].text, 0, 0,
+						  dummy, others,
+						  tokens + *n_tokens,
+						  str_buffer);
+			dummy = 0;
+			continue;
+		}
+
+		/* so the rest of the prompt is part of the key, up to there */
+		key = (int8_t)(dummy | others << 1);
+		h = vsc_hash(segs[n].text, len, key);
+		r = vsc_lookup(t->v.vsc, segs[n].text, len, key, h,
+			       tokens + *n_tokens);
+		if (r < 0) {
+			r = (ssize_t)vocab_encode(&t->v, segs[n].text, 0, 0,
+						  dummy, others,
+						  tokens + *n_tokens,
+						  str_buffer);
+			vsc_insert(t->v.vsc, segs[n].text, len, key, h,
+				   tokens + *n_tokens, (size_t)r);
+		}
+
+		*n_tokens += (size_t)r;
+		dummy = 0;
+	}
+
+	free(str_buffer);
+
 	if (eos)
 		tokens[(*n_tokens)++] = TOK_EOS;
 
 	return tokens;
+}
 
-bail1:
-	free(tokens);
+void
+clamma_txf_prompt_cache_stats(const txf_t *t, uint64_t *hits,
+			      uint64_t *misses, unsigned int *entries)
+{
+	vsc_state_t *sc = t->v.vsc;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&sc->mut_vsc);
+#endif
+	if (hits)
+		*hits = sc->hits;
+	if (misses)
+		*misses = sc->misses;
+	if (entries)
+		*entries = sc->count;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&sc->mut_vsc);
+#endif
+}
+
+/*
+ * Set the maximum number of segments the prompt cache holds, 0 disables it
+ */
+
+void
+clamma_txf_prompt_cache_limit(const txf_t *t, unsigned int entries)
+{
+	vsc_state_t *sc = t->v.vsc;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&sc->mut_vsc);
+#endif
+	sc->limit = entries;
+	vsc_evict(sc, entries);
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&sc->mut_vsc);
+#endif
+}
+
+/*
+ * Batch apis
+ *
+ * Each document gets a slot in the caller's flat output buffer sized by its
+ * worst case, so documents can be processed in any order by any thread.
+ * Once they are all done, the slots are compacted down in order and the
+ * caller's offsets[] rewritten to the final positions.
+ *
+ * The per-thread scratch buffer is kept by each worker and reused across
+ * jobs and batches.
+ */
+
+int
+clamma_vocab_batch_run(vocab_batch_t *vb, clamma_job_type_t type,
+		       size_t from, size_t to, char **scratch,
+		       size_t *scratch_len)
+{
+	size_t need = vb->v->max_token_length * 2 + 1 + 2;
+
+	if (need < sizeof(vb->v->utf8))
+		need = sizeof(vb->v->utf8);
+
+	if (*scratch_len < need) {
+		char *p = realloc(*scratch, need);
+
+		if (!p)
+			return 1;
+
+		*scratch = p;
+		*scratch_len = need;
+	}
+
+	for (size_t n = from; n < to; n++) {
+		const tok_id_t *tk = vb->tokens + vb->offsets[n];
+		char *o = vb->text, *o1;
+		int prev = 0;
+
+		switch (type) {
+		case CLAMMA_JOB_VOCAB_ENCODE:
+			vb->lens[n] = vocab_encode(vb->v, vb->texts[n],
+						   vb->bos, vb->eos, 1, 0,
+						   vb->tokens + vb->offsets[n],
+						   *scratch);
+			break;
+
+		case CLAMMA_JOB_VOCAB_DECODE:
+			/* offsets are in tokens, output is in chars */
+			o += vb->offsets[n] * vb->v->max_token_length + n;
+			o1 = o;
+
+			for (size_t m = 0; m < vb->lens[n]; m++) {
+				const char *piece;
+				size_t l;
+
+				if (tk[m] == TOK_BOS || tk[m] == TOK_EOS ||
+				    (size_t)tk[m] >= vb->v->size) {
+					prev = tk[m];
+					continue;
+				}
+
+				piece = vocab_decode(vb->v, *scratch, prev,
+						     tk[m]);
+				l = strlen(piece);
+				memcpy(o1, piece, l);
+				o1 += l;
+				prev = tk[m];
+			}
+
+			*o1 = '\0';
+			/* the decode len is in chars, including the NUL */
+			vb->lens[n] = (size_t)(o1 - o) + 1;
+			break;
+
+		default:
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+vocab_batch(vocab_batch_t *vb, clamma_job_type_t type, size_t count)
+{
+#if defined(LIBCLAMMA_SMP)
+	txf_session_state_t tss;
+	int ret;
+
+	if (count < 2 || !vb->v->pool || vb->v->pool->count < 2)
+		goto inline_run;
+
+	memset(&tss, 0, sizeof(tss));
+	if (clamma_smp_tss_init(&tss, vb->v->pool))
+		return 1;
+
+	ret = session_vocab_batch(&tss, type, vb, count);
+	if (!ret) {
+		clamma_smp_sync_point(&tss);
+		ret = !!clamma_atomic_load(&vb->failed);
+	}
+	clamma_smp_tss_deinit(&tss);
+
+	return ret;
+
+inline_run:
+#endif
+	{
+		char *scratch = NULL;
+		size_t scratch_len = 0;
+		int ret;
+
+		ret = clamma_vocab_batch_run(vb, type, 0, count, &scratch,
+					     &scratch_len);
+		free(scratch);
+
+		return ret;
+	}
+}
+
+/*
+ * Returns the number of token slots the caller must provide to
+ * clamma_vocab_encode_batch() for these texts
+ */
+
+size_t
+clamma_vocab_encode_batch_bound(const char * const *texts, size_t count)
+{
+	size_t total = 0;
+
+	for (size_t n = 0; n < count; n++)
+		total += strlen(texts[n]) + 3;
+
+	return total;
+}
+
+/*
+ * Encode count texts into the caller's flat tokens[] buffer of max_tokens
+ * entries.  offsets[] must have count + 1 entries, on return document n's
+ * tokens are tokens[offsets[n]] .. tokens[offsets[n + 1] - 1].
+ */
+
+int
+clamma_vocab_encode_batch(const txf_vocab_t *v, const char * const *texts,
+			  size_t count, int8_t bos, int8_t eos,
+			  tok_id_t *tokens, size_t max_tokens, size_t *offsets)
+{
+	vocab_batch_t vb;
+	size_t n, total = 0;
+	int ret = 1;
+
+	for (n = 0; n < count; n++) {
+		offsets[n] = total;
+		total += strlen(texts[n]) + 3;
+	}
+	offsets[count] = total;
+
+	if (total > max_tokens) {
+		fprintf(stderr, "%s: need %llu tokens, have %llu\n", __func__,
+				(unsigned long long)total,
+				(unsigned long long)max_tokens);
+		return 1;
+	}
+
+	memset(&vb, 0, sizeof(vb));
+	vb.v		= v;
+	vb.texts	= texts;
+	vb.tokens	= tokens;
+	vb.offsets	= offsets;
+	vb.bos		= bos;
+	vb.eos		= eos;
+	vb.lens		= malloc(count * sizeof(*vb.lens));
+	if (!vb.lens)
+		return 1;
+
+	if (vocab_batch(&vb, CLAMMA_JOB_VOCAB_ENCODE, count))
+		goto bail;
+
+	/* compact the slots down, destination is never after the source */
+
+	total = 0;
+	for (n = 0; n < count; n++) {
+		memmove(tokens + total, tokens + offsets[n],
+			vb.lens[n] * sizeof(*tokens));
+		offsets[n] = total;
+		total += vb.lens[n];
+	}
+	offsets[count] = total;
+
+	ret = 0;
+
+bail:
+	free(vb.lens);
+
+	return ret;
+}
+
+/*
+ * Returns the number of chars the caller must provide to
+ * clamma_vocab_decode_batch() for these token documents
+ */
+
+size_t
+clamma_vocab_decode_batch_bound(const txf_vocab_t *v, const size_t *offsets,
+				size_t count)
+{
+	return (offsets[count] - offsets[0]) * v->max_token_length + count;
+}
+
+/*
+ * Decode count token documents laid out as clamma_vocab_encode_batch()
+ * produces them into the caller's flat text[] buffer of max_text chars.
+ * Each document is NUL-terminated, text_offsets[] must have count + 1 entries
+ * and on return document n starts at text + text_offsets[n].  BOS and EOS are
+ * not emitted.
+ */
+
+int
+clamma_vocab_decode_batch(const txf_vocab_t *v, const tok_id_t *tokens,
+			  const size_t *offsets, size_t count, char *text,
+			  size_t max_text, size_t *text_offsets)
+{
+	size_t n, total;
+	vocab_batch_t vb;
+	int ret = 1;
+
+	if (clamma_vocab_decode_batch_bound(v, offsets, count) > max_text) {
+		fprintf(stderr, "%s: text buffer too small\n", __func__);
+		return 1;
+	}
+
+	memset(&vb, 0, sizeof(vb));
+	vb.v		= v;
+	vb.tokens	= (tok_id_t *)tokens + offsets[0];
+	vb.text		= text;
+	vb.lens		= malloc(count * sizeof(*vb.lens));
+	if (!vb.lens)
+		return 1;
+
+	/* slot n starts at (offsets[n] - offsets[0]) tokens in */
+
+	for (n = 0; n < count; n++) {
+		text_offsets[n] = offsets[n] - offsets[0];
+		vb.lens[n] = offsets[n + 1] - offsets[n];
+	}
+	vb.offsets = text_offsets;
+
+	if (vocab_batch(&vb, CLAMMA_JOB_VOCAB_DECODE, count))
+		goto bail;
+
+	total = 0;
+	for (n = 0; n < count; n++) {
+		char *src = text + (text_offsets[n] * v->max_token_length) + n;
+
+		memmove(text + total, src, vb.lens[n]);
+		text_offsets[n] = total;
+		total += vb.lens[n];
+	}
+	text_offsets[count] = total;
+
+	ret = 0;
+
+bail:
+	free(vb.lens);
 
-	return NULL;
+	return ret;
 }
@@ -33,107 +33,2010 @@
 
 #include "private.h"
 
-static cwc_state_t cwc;
+/*
+ * On Linux, batched reads go through an io_uring if the kernel allows it.
+ * Build with LIBCLAMMA_NO_IO_URING to only ever use pread().
+ */
+
+#if defined(__linux__) && defined(__has_include) && \
+    !defined(LIBCLAMMA_NO_IO_URING)
+#if __has_include(<linux/io_uring.h>)
+#define CLAMMA_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+/*
+ * Each MALLOC_CACHE model has its own cache, with its own limit.  There's
+ * also an optional budget for all of them together, a model that needs room
+ * evicts its own entries until the total is back under it.
+ */
+
+static size_t cwc_budget;
+static uint64_t cwc_total; /* atomic */
+
+static cwc_bucket_t *
+cwc_bucket(cwc_state_t *cw, uint64_t ofs, size_t len)
+{
+	uint64_t h = (ofs ^ ((uint64_t)len * 0x9e3779b97f4a7c15ull)) *
+							0xff51afd7ed558ccdull;
+
+	return &cw->bucket[(h >> 32) % CLAMMA_CWC_HASH];
+}
+
+#if defined(LIBCLAMMA_SMP)
+/* only the wait for a contended lock is timed */
+
+static void
+cwc_lock(cwc_state_t *cw, clamma_mutex_t *m)
+{
+	uint64_t start;
+
+	if (!clamma_smp_mutex_trylock(m))
+		return;
+
+	start = clamma_timestamp_ns();
+	clamma_mutex_lock(m);
+	clamma_atomic_add64(&cw->lock_wait_ns, clamma_timestamp_ns() - start);
+}
+#endif
+
+/* call with the bucket locked */
+
+static cwc_t *
+cwc_find(cwc_bucket_t *b, uint64_t ofs, size_t len)
+{
+	cwc_t *c = b->head;
+
+	while (c) {
+		if (c->offset == ofs && c->len == len)
+			return c;
+		c = c->hnext;
+	}
+
+	return NULL;
+}
+
+/*
+ * Entries and slabs are aligned so they can be read into with O_DIRECT
+ */
+
+static void *
+cwc_aalloc(size_t size)
+{
+#if defined(_WIN32)
+	return _aligned_malloc(size, CLAMMA_DIRECT_ALIGN);
+#else
+	void *p;
+
+	if (posix_memalign(&p, CLAMMA_DIRECT_ALIGN, size))
+		return NULL;
+
+	return p;
+#endif
+}
+
+static void
+cwc_afree(void *p)
+{
+#if defined(_WIN32)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+/*
+ * 2MB aligned anonymous memory, advised for transparent hugepages.  len is
+ * rounded up to 2MB, clamma_huge_unmap() does the same with it.
+ */
+
+void *
+clamma_huge_map(size_t len)
+{
+#if defined(_WIN32)
+	return _aligned_malloc(len, CLAMMA_CWA_CHUNK);
+#else
+	uint8_t *p, *a;
+	size_t lead;
+
+	len = (len + CLAMMA_CWA_CHUNK - 1) & ~(size_t)(CLAMMA_CWA_CHUNK - 1);
+
+	/* over-allocate, then trim it down to a 2MB aligned len */
+
+	p = mmap(NULL, len + CLAMMA_CWA_CHUNK, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	a = (uint8_t *)(((uintptr_t)p + CLAMMA_CWA_CHUNK - 1) &
+			~(uintptr_t)(CLAMMA_CWA_CHUNK - 1));
+	lead = (size_t)(a - p);
+	if (lead)
+		munmap(p, lead);
+	if (CLAMMA_CWA_CHUNK - lead)
+		munmap(a + len, CLAMMA_CWA_CHUNK - lead);
+#if defined(MADV_HUGEPAGE)
+	madvise(a, len, MADV_HUGEPAGE);
+#endif
+
+	return a;
+#endif
+}
+
+void
+clamma_huge_unmap(void *p, size_t len)
+{
+#if defined(_WIN32)
+	(void)len;
+	_aligned_free(p);
+#else
+	munmap(p, (len + CLAMMA_CWA_CHUNK - 1) &
+		  ~(size_t)(CLAMMA_CWA_CHUNK - 1));
+#endif
+}
+
+/*
+ * Arena for the cached weights
+ */
+
+/* call with the arena locked */
+
+static void
+cwa_unlink_free(cwa_class_t *cl, cwa_free_t *f)
+{
+	if (f->prev)
+		f->prev->next = f->next;
+	else
+		cl->free = f->next;
+	if (f->next)
+		f->next->prev = f->prev;
+}
+
+/* call with the arena locked */
+
+static void
+cwa_chunk_destroy(cwa_t *a, cwa_chunk_t *ch)
+{
+	cwa_class_t *cl = ch->cls;
+	unsigned int n;
+
+	if (cl) {
+		/* its blocks are all on the free list */
+		for (n = 0; n < ch->carved; n++)
+			cwa_unlink_free(cl, (cwa_free_t *)((uint8_t *)ch +
+					CLAMMA_CWA_HDR + n * ch->size));
+		a->free -= (uint64_t)ch->carved * ch->size;
+
+		if (ch->prev)
+			ch->prev->next = ch->next;
+		else
+			cl->chunks = ch->next;
+		if (ch->next)
+			ch->next->prev = ch->prev;
+		if (cl->spare == ch)
+			cl->spare = NULL;
+	}
+
+	a->mapped -= ch->len;
+	clamma_huge_unmap(ch, ch->len);
+}
+
+static void *
+cwa_alloc(cwa_t *a, size_t size)
+{
+	cwa_class_t *cl = NULL, *fit = NULL;
+	cwa_chunk_t *ch;
+	uint8_t *b = NULL;
+	unsigned int n;
+	size_t len;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&a->mut);
+#endif
+	for (n = 0; n < CLAMMA_ARRAY_SIZE(a->cls); n++) {
+		if (a->cls[n].size == size || !a->cls[n].size) {
+			cl = &a->cls[n];
+			cl->size = size;
+			break;
+		}
+		if (a->cls[n].size > size &&
+		    (!fit || a->cls[n].size < fit->size))
+			fit = &a->cls[n];
+	}
+
+	/*
+	 * Out of classes, the block goes in the closest bigger class unless
+	 * that costs more than a chunk to itself
+	 */
+
+	if (!cl && fit && CLAMMA_CWA_HDR + fit->size <=
+			((CLAMMA_CWA_HDR + size + CLAMMA_CWA_CHUNK - 1) &
+					~(size_t)(CLAMMA_CWA_CHUNK - 1))) {
+		cl = fit;
+		size = cl->size;
+	}
+
+	if (!cl && !a->warned) {
+		fprintf(stderr, "%s: all %u size classes in use, %zu byte blocks "
+			"get a chunk each\n", __func__, CLAMMA_CWA_CLASSES, size);
+		a->warned = 1;
+	}
+
+	a->allocs++;
+
+	if (cl && cl->free) {
+		cwa_free_t *f = cl->free;
+
+		cwa_unlink_free(cl, f);
+		a->free -= size;
+		a->reused++;
+
+		ch = (cwa_chunk_t *)((uintptr_t)f &
+				     ~(uintptr_t)(CLAMMA_CWA_CHUNK - 1));
+		if (cl->spare == ch)
+			cl->spare = NULL;
+		b = (uint8_t *)f;
+		goto used;
+	}
+
+	if (cl && cl->chunks && cl->chunks->carved < cl->chunks->blocks) {
+		ch = cl->chunks;
+		goto carve;
+	}
+
+	/*
+	 * Blocks that don't fit in a standard chunk have a chunk to
+	 * themselves, so they can always be found from the 2MB alignment
+	 */
+
+	len = CLAMMA_CWA_CHUNK;
+	if (CLAMMA_CWA_HDR + size > len)
+		len = (CLAMMA_CWA_HDR + size + CLAMMA_CWA_CHUNK - 1) &
+					~(size_t)(CLAMMA_CWA_CHUNK - 1);
+
+	ch = clamma_huge_map(len);
+	if (!ch)
+		goto bail;
+
+	memset(ch, 0, sizeof(*ch));
+	ch->len		= len;
+	ch->size	= size;
+	ch->blocks	= CLAMMA_CWA_HDR + size > CLAMMA_CWA_CHUNK ? 1 :
+				(unsigned int)((len - CLAMMA_CWA_HDR) / size);
+	ch->cls		= cl;
+	a->mapped	+= len;
+
+	if (cl) {
+		ch->next = cl->chunks;
+		if (ch->next)
+			ch->next->prev = ch;
+		cl->chunks = ch;
+	}
+
+carve:
+	b = (uint8_t *)ch + CLAMMA_CWA_HDR + (size_t)ch->carved++ * size;
+
+used:
+	ch->used++;
+	a->in_use += size;
+
+bail:
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&a->mut);
+#endif
+
+	return b;
+}
+
+static void
+cwa_release(cwa_t *a, void *b)
+{
+	cwa_chunk_t *ch = (cwa_chunk_t *)((uintptr_t)b &
+					  ~(uintptr_t)(CLAMMA_CWA_CHUNK - 1));
+	cwa_class_t *cl = ch->cls;
+	cwa_free_t *f = (cwa_free_t *)b;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&a->mut);
+#endif
+	a->in_use -= ch->size;
+	ch->used--;
+
+	if (!cl) {
+		cwa_chunk_destroy(a, ch);
+		goto bail;
+	}
+
+	f->prev = NULL;
+	f->next = cl->free;
+	if (f->next)
+		f->next->prev = f;
+	cl->free = f;
+	a->free += ch->size;
+
+	if (!ch->used) {
+		/* keep one free chunk per class, give any others back */
+		if (!cl->spare)
+			cl->spare = ch;
+		else
+			cwa_chunk_destroy(a, ch);
+	}
+
+bail:
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&a->mut);
+#endif
+}
+
+static void
+cwc_free(cwc_state_t *cw, cwc_t *c)
+{
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_destroy(&c->mut_load);
+#endif
+	if (c->blk)
+		cwa_release(&cw->arena, c->blk);
+	free(c);
+}
+
+/* call with mut_cwc held */
+
+static void
+cwc_ring_unlink(cwc_state_t *cw, cwc_t *c)
+{
+	if (c->cnext == c)
+		cw->hand = NULL;
+	else {
+		if (cw->hand == c)
+			cw->hand = c->cnext;
+		c->cprev->cnext = c->cnext;
+		c->cnext->cprev = c->cprev;
+	}
+	cw->count--;
+}
+
+static void
+cwc_account(cwc_state_t *cw, size_t size, int add)
+{
+	if (add) {
+		cw->cwc_alloced += size;
+		clamma_atomic_add64(&cwc_total, size);
+	} else {
+		cw->cwc_alloced -= size;
+		clamma_atomic_add64(&cwc_total, -(uint64_t)size);
+	}
+}
+
+/* is there no room for want more bytes? */
+
+static int
+cwc_full(const cwc_state_t *cw, size_t limit, size_t want)
+{
+	return (limit && cw->cwc_alloced + want > limit) ||
+	       (cwc_budget && clamma_atomic_load(&cwc_total) + want > cwc_budget);
+}
+
+/*
+ * Call with mut_cwc held.  Sweep the clock hand evicting unpinned entries
+ * that have not been used since the hand last passed, until there is room for
+ * want more bytes.  We give up if everything is pinned.
+ */
+
+static void
+cwc_evict(cwc_state_t *cw, size_t limit, size_t want)
+{
+	unsigned int scanned = 0, budget = cw->count * 2;
+
+	while (cw->hand && cwc_full(cw, limit, want) && scanned++ < budget) {
+		cwc_t *c = cw->hand, **pc;
+		cwc_bucket_t *b;
+
+		cw->hand = c->cnext;
+
+		if (clamma_atomic_load(&c->refcount) ||
+		    !clamma_atomic_load(&c->ready))
+			continue;
+
+		if (clamma_atomic_load(&c->referenced)) {
+			clamma_atomic_store(&c->referenced, 0);
+			continue;
+		}
+
+		if (c->layer != CLAMMA_CWC_NO_LAYER && cw->pin[c->layer])
+			continue;
+
+		/* pins are only taken with the bucket locked */
+
+		b = cwc_bucket(cw, c->offset, c->len);
+#if defined(LIBCLAMMA_SMP)
+		cwc_lock(cw, &b->mut);
+#endif
+		if (clamma_atomic_load(&c->refcount)) {
+#if defined(LIBCLAMMA_SMP)
+			clamma_mutex_unlock(&b->mut);
+#endif
+			continue;
+		}
+
+		pc = &b->head;
+		while (*pc != c)
+			pc = &(*pc)->hnext;
+		*pc = c->hnext;
+#if defined(LIBCLAMMA_SMP)
+		clamma_mutex_unlock(&b->mut);
+#endif
+
+		cwc_ring_unlink(cw, c);
+		cwc_account(cw, c->len, 0);
+		cw->cwc_evicted++;
+		cw->cs[c->cls].evictions++;
+		cw->cs[c->cls].resident -= c->len;
+		cwc_free(cw, c);
+	}
+}
+
+/*
+ * Positional reads, so several threads can be reading different weights from
+ * the one fd at the same time without having to serialize on the file offset.
+ */
+
+static int
+cwc_pread(const txf_t *t, void *dst, size_t len, size_t need, uint64_t ofs)
+{
+#if defined(_WIN32) && defined(LIBCLAMMA_SMP)
+	cwc_state_t *cw = t->cwc;
+#endif
+	uint8_t *p = (uint8_t *)dst;
+	size_t done = 0;
+	ssize_t ar;
+
+	while (done < len) {
+#if defined(_WIN32)
+		/* no pread() */
+#if defined(LIBCLAMMA_SMP)
+		clamma_mutex_lock(&cw->mut_fd);
+#endif
+		lseek(t->fd, (off_t)ofs, SEEK_SET);
+		ar = read(t->fd, p, len - done);
+#if defined(LIBCLAMMA_SMP)
+		clamma_mutex_unlock(&cw->mut_fd);
+#endif
+#else
+		ar = pread(t->fd, p, len - done, (off_t)ofs);
+#endif
+		if (ar < 0 && errno == EINTR)
+			continue;
+		if (!ar && done >= need)
+			/* aligned read of the last block of the file */
+			break;
+		if (ar <= 0) {
+			fprintf(stderr, "%s: read of %llu at %llu failed: %d\n",
+					__func__, (unsigned long long)(len - done),
+					(unsigned long long)ofs, (int)ar);
+			return 1;
+		}
+
+		p += ar;
+		ofs += (uint64_t)ar;
+		done += (size_t)ar;
+	}
+
+	return 0;
+}
+
+/* read from the model file outside of the cache, len and need as above */
+
+int
+clamma_model_read(const txf_t *t, void *dst, size_t len, size_t need,
+		  uint64_t ofs)
+{
+	return cwc_pread(t, dst, len, need, ofs);
+}
+
+#if defined(CLAMMA_IO_URING)
+
+/*
+ * Minimal io_uring using the raw syscalls, so there's no dependency on
+ * liburing.  It's only used by one thread at a time, the prefetch thread, or
+ * the forward pass when there's no prefetch thread.
+ */
+
+static int
+cwc_ring_init(cwc_ring_t *r)
+{
+	struct io_uring_params p;
+	int fd;
+
+	r->fd = -1;
+
+	memset(&p, 0, sizeof(p));
+	fd = (int)syscall(__NR_io_uring_setup, CLAMMA_CWC_RING_DEPTH, &p);
+	if (fd < 0)
+		return 1; /* old kernel, or not allowed */
+
+	r->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_map_len = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_map_len > r->sq_map_len)
+			r->sq_map_len = r->cq_map_len;
+		r->cq_map_len = r->sq_map_len;
+	}
+
+	r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (r->sq_map == MAP_FAILED)
+		goto bail;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		r->cq_map = r->sq_map;
+	else {
+		r->cq_map = mmap(NULL, r->cq_map_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, fd,
+				 IORING_OFF_CQ_RING);
+		if (r->cq_map == MAP_FAILED)
+			goto bail1;
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		goto bail2;
+
+	r->sq_head	= (unsigned int *)((uint8_t *)r->sq_map + p.sq_off.head);
+	r->sq_tail	= (unsigned int *)((uint8_t *)r->sq_map + p.sq_off.tail);
+	r->sq_mask	= (unsigned int *)((uint8_t *)r->sq_map +
+							p.sq_off.ring_mask);
+	r->sq_array	= (unsigned int *)((uint8_t *)r->sq_map + p.sq_off.array);
+	r->cq_head	= (unsigned int *)((uint8_t *)r->cq_map + p.cq_off.head);
+	r->cq_tail	= (unsigned int *)((uint8_t *)r->cq_map + p.cq_off.tail);
+	r->cq_mask	= (unsigned int *)((uint8_t *)r->cq_map +
+							p.cq_off.ring_mask);
+	r->cqes		= (uint8_t *)r->cq_map + p.cq_off.cqes;
+	r->entries	= p.sq_entries;
+	r->fd		= fd;
+
+	return 0;
+
+bail2:
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+bail1:
+	munmap(r->sq_map, r->sq_map_len);
+bail:
+	close(fd);
+
+	return 1;
+}
+
+static void
+cwc_ring_deinit(cwc_ring_t *r)
+{
+	if (r->fd < 0)
+		return;
+
+	munmap(r->sqes, r->sqes_len);
+	if (r->cq_map != r->sq_map)
+		munmap(r->cq_map, r->cq_map_len);
+	munmap(r->sq_map, r->sq_map_len);
+	close(r->fd);
+	r->fd = -1;
+}
+
+/*
+ * Keep up to the ring depth of reads in flight and reap them as they
+ * complete.  Anything the ring didn't do (short reads, unsupported op on an
+ * old kernel) is left with result 1 for the caller to finish with pread().
+ */
+
+static void
+cwc_ring_read(const txf_t *t, cwc_ring_t *r, cwc_read_t *rd, unsigned int n,
+	      void (*done)(cwc_read_t *rd))
+{
+	cwc_state_t *cw = t->cwc;
+	struct io_uring_sqe *sqes = (struct io_uring_sqe *)r->sqes;
+	struct io_uring_cqe *cqes = (struct io_uring_cqe *)r->cqes;
+	unsigned int m = 0, queued = 0, inflight = 0, tail, head;
+	int ret;
+
+	while ((m < n && !cw->ring_broken) || queued || inflight) {
+
+		tail = *r->sq_tail;
+		while (m < n && !cw->ring_broken &&
+		       queued + inflight < r->entries) {
+			struct io_uring_sqe *sqe;
+			unsigned int i = tail & *r->sq_mask;
+
+			if (rd[m].len > (1u << 30)) {
+				/* too big for one sqe, let pread() do it */
+				rd[m++].result = 1;
+				continue;
+			}
+
+			sqe = &sqes[i];
+			memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode	= IORING_OP_READ;
+			sqe->fd		= t->fd;
+			sqe->off	= rd[m].ofs;
+			sqe->addr	= (uint64_t)(uintptr_t)rd[m].dst;
+			sqe->len	= (uint32_t)rd[m].len;
+			sqe->user_data	= m;
+			r->sq_array[i]	= i;
+
+			tail++;
+			queued++;
+			m++;
+		}
+		__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+		if (!queued && !inflight)
+			continue;
+
+		ret = (int)syscall(__NR_io_uring_enter, r->fd, queued, 1,
+				   IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN ||
+			    errno == EBUSY)
+				continue;
+			/*
+			 * Not expected after a good setup, stop using the
+			 * ring and let pread() do whatever didn't complete
+			 */
+			fprintf(stderr, "%s: io_uring_enter: %d\n",
+					__func__, errno);
+			cw->ring_broken = 1;
+			break;
+		}
+		queued -= (unsigned int)ret;
+		inflight += (unsigned int)ret;
+
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &cqes[head & *r->cq_mask];
+			cwc_read_t *c = &rd[cqe->user_data];
+
+			c->result = cqe->res < 0 || (size_t)cqe->res < c->need;
+			if (cqe->res == -EINVAL) {
+				/* no IORING_OP_READ before 5.6 */
+				fprintf(stderr, "%s: io_uring can't read, "
+						"using pread\n", __func__);
+				cw->ring_broken = 1;
+			}
+			if (!c->result && done)
+				done(c);
+			head++;
+			inflight--;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+#endif
+
+/*
+ * Read a batch of weights.  With io_uring these are all in flight at once,
+ * otherwise one after the other.  done() is called on each read as soon as it
+ * has finished, with result 0 if it succeeded.
+ */
+
+static void
+cwc_read_batch(const txf_t *t, cwc_read_t *rd, unsigned int n,
+	       void (*done)(cwc_read_t *rd))
+{
+	cwc_state_t *cw = t->cwc;
+	unsigned int m;
+
+	for (m = 0; m < n; m++)
+		rd[m].result = 1;
+
+#if defined(CLAMMA_IO_URING)
+	if (cw->ring.fd >= 0 && !cw->ring_broken && n > 1)
+		cwc_ring_read(t, &cw->ring, rd, n, done);
+#endif
+
+	for (m = 0; m < n; m++) {
+		if (!rd[m].result)
+			continue;
+		rd[m].result = cwc_pread(t, rd[m].dst, rd[m].len, rd[m].need,
+					 rd[m].ofs);
+		if (done)
+			done(&rd[m]);
+	}
+}
+
+static int
+cwc_ix_cmp(const void *a, const void *b)
+{
+	const cwc_ix_t *x = (const cwc_ix_t *)a, *y = (const cwc_ix_t *)b;
+
+	if (x->ofs != y->ofs)
+		return x->ofs < y->ofs ? -1 : 1;
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+
+	return 0;
+}
+
+/* find which layer and class of tensor the entry's weights are */
+
+static void
+cwc_classify(const cwc_state_t *cw, cwc_t *c)
+{
+	cwc_ix_t k, *ix = NULL;
+
+	c->layer	= CLAMMA_CWC_NO_LAYER;
+	c->cls		= CLAMMA_WCLASS_OTHER;
+
+	k.ofs = c->offset;
+	k.len = c->len;
+	if (cw->ix)
+		ix = bsearch(&k, cw->ix, cw->ix_count, sizeof(k), cwc_ix_cmp);
+	if (ix) {
+		c->layer	= ix->layer;
+		c->cls		= ix->cls;
+	}
+}
+
+/*
+ * Find or make the entry for the weights at ofs.
+ *
+ * Returns 1 if the caller made the entry and must load it, then call
+ * cwc_loaded() on it.  Otherwise *pc is the existing entry, or NULL if there
+ * was none and it was not possible to make one.  Entries come back pinned,
+ * except existing entries for prefetch.
+ *
+ * Hits only take the lock for the hash bucket.  On a miss, the entry is put
+ * in the table before it is loaded, so other threads wanting the same weights
+ * wait for the one load instead of duplicating it.
+ *
+ * Prefetch never evicts to make room.
+ */
+
+static int
+cwc_claim(const txf_t *t, uint64_t ofs, size_t size, int prefetch, cwc_t **pc)
+{
+	cwc_state_t *cw = t->cwc;
+	cwc_bucket_t *b = cwc_bucket(cw, ofs, size);
+	cwc_t *c, *c1;
+
+	*pc = NULL;
+
+#if defined(LIBCLAMMA_SMP)
+	cwc_lock(cw, &b->mut);
+#endif
+	c = cwc_find(b, ofs, size);
+	if (c && !prefetch) {
+		clamma_atomic_add(&c->refcount, 1);
+		clamma_atomic_store(&c->referenced, 1);
+	}
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&b->mut);
+#endif
+
+	if (c) {
+		if (!prefetch)
+			*pc = c;
+		return 0;
+	}
+
+	/* miss... make room and account for it */
+
+#if defined(LIBCLAMMA_SMP)
+	cwc_lock(cw, &cw->mut_cwc);
+#endif
+	if (cwc_full(cw, t->cache_limit, size)) {
+		if (prefetch) {
+			/* only prefetch into free space */
+			cw->cwc_prefetch_skipped++;
+#if defined(LIBCLAMMA_SMP)
+			clamma_mutex_unlock(&cw->mut_cwc);
+#endif
+			return 0;
+		}
+		cwc_evict(cw, t->cache_limit, size);
+	}
+	cwc_account(cw, size, 1);
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_cwc);
+#endif
+
+	c = malloc(sizeof(*c));
+	if (!c)
+		goto oom;
+	memset(c, 0, sizeof(*c));
+	c->offset	= ofs;
+	c->len		= size;
+	cwc_classify(cw, c);
+
+	/*
+	 * The block starts with room for the pointer back to the entry, so the
+	 * weights are 64-byte aligned.  For O_DIRECT, the read also has to
+	 * start and end on aligned file offsets, into an aligned buffer, with
+	 * the weights at their offset within the read.
+	 */
+
+	if (t->direct) {
+		size_t head = ofs & (CLAMMA_DIRECT_ALIGN - 1);
+
+		c->rlen	= (head + size + CLAMMA_DIRECT_ALIGN - 1) &
+					~(size_t)(CLAMMA_DIRECT_ALIGN - 1);
+		c->blk	= cwa_alloc(&cw->arena, CLAMMA_DIRECT_ALIGN + c->rlen);
+		c->buf	= (uint8_t *)c->blk + CLAMMA_DIRECT_ALIGN;
+		c->data	= c->buf + head;
+	} else {
+		c->rlen	= size;
+		c->blk	= cwa_alloc(&cw->arena, 64 + ((size + 63) & ~(size_t)63));
+		c->buf	= (uint8_t *)c->blk + 64;
+		c->data	= c->buf;
+	}
+	if (!c->blk) {
+		free(c);
+		goto oom;
+	}
+
+	c->refcount	= 1; /* the loader's pin */
+	c->referenced	= 1;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_init(&c->mut_load);
+	clamma_mutex_lock(&c->mut_load);
+
+	cwc_lock(cw, &b->mut);
+	c1 = cwc_find(b, ofs, size);
+	if (c1) {
+		/* somebody else got there first, use theirs */
+		if (!prefetch) {
+			clamma_atomic_add(&c1->refcount, 1);
+			clamma_atomic_store(&c1->referenced, 1);
+			*pc = c1;
+		}
+		clamma_mutex_unlock(&b->mut);
+
+		clamma_mutex_unlock(&c->mut_load);
+		cwc_free(cw, c);
+		goto bail;
+	}
+#else
+	(void)c1;
+#endif
+	c->hnext = b->head;
+	b->head = c;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&b->mut);
+
+	cwc_lock(cw, &cw->mut_cwc);
+#endif
+	if (cw->hand) {
+		/* just behind the hand, so it is the last to be considered */
+		c->cnext = cw->hand;
+		c->cprev = cw->hand->cprev;
+		c->cprev->cnext = c;
+		cw->hand->cprev = c;
+	} else {
+		c->cnext = c->cprev = c;
+		cw->hand = c;
+	}
+	cw->count++;
+	cw->cwc_created++;
+	cw->cwc_fetched += size;
+	cw->cs[c->cls].resident += size;
+	cw->cs[c->cls].bytes_read += c->rlen;
+	if (prefetch)
+		cw->cwc_prefetched += size;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_cwc);
+#endif
+
+	*pc = c;
+
+	return 1;
+
+oom:
+	fprintf(stderr, "%s: allocate %llu size failed\n",
+			__func__, (unsigned long long)size);
+#if defined(LIBCLAMMA_SMP)
+bail:
+#endif
+#if defined(LIBCLAMMA_SMP)
+	cwc_lock(cw, &cw->mut_cwc);
+#endif
+	cwc_account(cw, size, 0);
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_cwc);
+#endif
+
+	return 0;
+}
+
+static void
+cwc_loaded(cwc_t *c, int ok)
+{
+	/*
+	 * For release, from the weights back to the entry.  With O_DIRECT this
+	 * may be in the part of the read before the weights, so only now.
+	 */
+	((cwc_t **)c->data)[-1] = c;
+
+	clamma_atomic_store(&c->ready, ok ? 1 : -1);
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&c->mut_load);
+#endif
+}
+
+static void
+cwc_entry_read(cwc_t *c, cwc_read_t *rd)
+{
+	rd->dst		= c->buf;
+	rd->ofs		= c->offset - (uint64_t)(c->data - c->buf);
+	rd->len		= c->rlen;
+	rd->need	= (size_t)(c->data - c->buf) + c->len;
+	rd->opaque	= c;
+}
+
+/*
+ * Returns a pinned pointer to the cached weights, loading them on a miss.
+ * Misses on different weights in different threads are read in parallel.
+ */
+
+static const void *
+cwc_get(const txf_t *t, const void *weight, size_t size)
+{
+	cwc_state_t *cw = t->cwc;
+	uint64_t ofs, start = 0;
+	cwc_t *c;
+
+	ofs = (uint64_t)((uint8_t *)weight - ((uint8_t *)t->data));
+
+	if (cwc_claim(t, ofs, size, 0, &c)) {
+		cwc_read_t rd;
+
+		start = clamma_timestamp_ns();
+		cwc_entry_read(c, &rd);
+		cwc_loaded(c, !cwc_pread(t, rd.dst, rd.len, rd.need, rd.ofs));
+		goto check;
+	}
+
+	if (!c)
+		return NULL;
+
+#if defined(LIBCLAMMA_SMP)
+	if (!clamma_atomic_load(&c->ready)) {
+		/* wait for the loader (probably prefetch) to finish with it */
+		start = clamma_timestamp_ns();
+		clamma_mutex_lock(&c->mut_load);
+		clamma_mutex_unlock(&c->mut_load);
+	}
+#endif
+	clamma_atomic_add64(&cw->cwc_touched, size);
+
+check:
+	if (start) {
+		/* the caller had to wait for the weights to come from disk */
+		uint64_t d = clamma_timestamp_ns() - start;
+
+		clamma_atomic_add64(&cw->cwc_stall_ns, d);
+		clamma_atomic_add64(&cw->cwc_stalls, 1);
+		clamma_atomic_add64(&cw->cs[c->cls].stall_ns, d);
+		clamma_atomic_add64(&cw->cs[c->cls].misses, 1);
+	} else
+		clamma_atomic_add64(&cw->cs[c->cls].hits, 1);
+
+	if (clamma_atomic_load(&c->ready) != 1) {
+		clamma_atomic_add(&c->refcount, -1);
+		return NULL;
+	}
+
+	return c->data;
+}
+
+/*
+ * Streaming mode
+ *
+ * Layer l's weights are read into one slab with one large read per tensor,
+ * all issued together, while the forward pass is running layer l - 1 from the
+ * other slab.  Weights that aren't part of a layer, like the token embeddings,
+ * still go through the cache.
+ */
+
+/* publish the outcome of a fill and wake any lookups waiting for it */
+
+static void
+cws_set_ready(cwc_state_t *cw, cws_slab_t *sl, long r)
+{
+#if defined(LIBCLAMMA_SMP)
+	unsigned int n;
+
+	clamma_mutex_lock(&cw->mut_stream);
+	clamma_atomic_store(&sl->ready, r);
+	n = sl->ready_waiters;
+	sl->ready_waiters = 0;
+	clamma_mutex_unlock(&cw->mut_stream);
+
+	while (n--)
+		clamma_sem_post(&sl->sem_ready);
+#else
+	(void)cw;
+	clamma_atomic_store(&sl->ready, r);
+#endif
+}
+
+/* drop a ref, waking whoever waits for the slab to be let go */
+
+static void
+cws_unref(cws_slab_t *sl)
+{
+#if defined(LIBCLAMMA_SMP)
+	if (clamma_atomic_add(&sl->refcount, -1) == 1 &&
+	    clamma_atomic_load(&sl->draining))
+		clamma_sem_post(&sl->sem_idle);
+#else
+	clamma_atomic_add(&sl->refcount, -1);
+#endif
+}
+
+/*
+ * Wait until nobody holds a ref on the slab.  Its stage is already -1, so no
+ * new refs stick.  A post left over from a ref that went away before we
+ * started waiting just costs another look at refcount.
+ */
+
+static void
+cws_drain(cws_slab_t *sl)
+{
+#if defined(LIBCLAMMA_SMP)
+	clamma_atomic_store(&sl->draining, 1);
+	while (clamma_atomic_load(&sl->refcount))
+		clamma_sem_wait(&sl->sem_idle);
+	clamma_atomic_store(&sl->draining, 0);
+#else
+	(void)sl;
+#endif
+}
+
+static int
+cws_fill(const txf_t *t, cws_slab_t *sl)
+{
+	cwc_state_t *cw = t->cwc;
+	cwc_read_t rd[CLAMMA_LAYER_WEIGHTS_MAX];
+	uint64_t start = clamma_timestamp_ns();
+	size_t total = 0;
+	unsigned int n;
+
+	for (n = 0; n < sl->count; n++) {
+		uint64_t ofs = (uint64_t)((uint8_t *)sl->w[n].p -
+					  (uint8_t *)t->data);
+		size_t head = (size_t)(ofs & (CLAMMA_DIRECT_ALIGN - 1));
+
+		if (!t->direct)
+			head = 0;
+
+		/* cws_request() left room for the alignment */
+
+		rd[n].dst	= sl->buf + sl->ofs[n] - head;
+		rd[n].ofs	= ofs - head;
+		rd[n].need	= head + sl->w[n].len;
+		rd[n].len	= rd[n].need;
+		if (t->direct)
+			rd[n].len = (rd[n].len + CLAMMA_DIRECT_ALIGN - 1) &
+					~(size_t)(CLAMMA_DIRECT_ALIGN - 1);
+		total		+= sl->w[n].len;
+	}
+
+	cwc_read_batch(t, rd, sl->count, NULL);
+
+	for (n = 0; n < sl->count; n++)
+		if (rd[n].result) {
+			cws_set_ready(cw, sl, -1);
+			return 1;
+		}
+
+	clamma_atomic_add64(&cw->stream_bytes, total);
+	clamma_atomic_add64(&cw->stream_ns, clamma_timestamp_ns() - start);
+	cws_set_ready(cw, sl, 1);
+
+	return 0;
+}
+
+/*
+ * Assign a slab to hold stage (a layer, or n_layers for the classifier) if
+ * none has it already.  The slab we take is the one not holding the stage
+ * before it, which the forward pass is about to use or is using now.  Only
+ * one pass on the model calls this at a time, see
+ * clamma_weight_stream_pass_begin().
+ */
+
+static cws_slab_t *
+cws_request(const txf_t *t, unsigned int stage)
+{
+	cwc_state_t *cw = t->cwc;
+	unsigned int prev = stage ? stage - 1 : t->c.n_layers;
+	cws_slab_t *sl = NULL;
+	size_t o = 0;
+	unsigned int n;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&cw->mut_stream);
+#endif
+	if (cw->slab[0].stage == (int)stage || cw->slab[1].stage == (int)stage)
+		goto bail;
+
+	sl = &cw->slab[cw->slab[0].stage == (int)prev];
+
+	/* lookups and the prefetch thread seeing the slab change leave it be */
+
+	sl->stage = -1;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_stream);
+#endif
+
+	/* wait for any still using it to be done, without holding up a fill */
+
+	cws_drain(sl);
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&cw->mut_stream);
+#endif
+	clamma_atomic_store(&sl->ready, 0);
+	sl->count = clamma_layer_weights(t, stage, sl->w);
+	for (n = 0; n < sl->count; n++) {
+		uint64_t fo = (uint64_t)((uint8_t *)sl->w[n].p -
+					 (uint8_t *)t->data);
+
+		/* with O_DIRECT the read starts aligned, ahead of the weights */
+
+		if (t->direct)
+			o += (size_t)(fo & (CLAMMA_DIRECT_ALIGN - 1));
+		sl->ofs[n] = o;
+		o = (o + sl->w[n].len + CLAMMA_DIRECT_ALIGN - 1) &
+					~(size_t)(CLAMMA_DIRECT_ALIGN - 1);
+	}
+	sl->seq = ++cw->stream_seq;
+	sl->stage = (int)stage;
+
+bail:
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_stream);
+#endif
+
+	return sl;
+}
+
+static const void *
+cws_lookup(const txf_t *t, const void *weight, size_t size)
+{
+	cwc_state_t *cw = t->cwc;
+	unsigned int m, n;
+	long r;
+
+	for (m = 0; m < CLAMMA_ARRAY_SIZE(cw->slab); m++) {
+		cws_slab_t *sl = &cw->slab[m];
+		int stage = sl->stage;
+
+		if (stage < 0)
+			continue;
+
+		for (n = 0; n < sl->count; n++)
+			if (sl->w[n].p == weight && sl->w[n].len == size)
+				break;
+		if (n == sl->count)
+			continue;
+
+		clamma_atomic_add(&sl->refcount, 1);
+		if (sl->stage != stage) {
+			/* it's being reassigned */
+			cws_unref(sl);
+			continue;
+		}
+
+		r = clamma_atomic_load(&sl->ready);
+#if defined(LIBCLAMMA_SMP)
+		if (!r) {
+			/* sleep until cws_set_ready() says how the fill went */
+			uint64_t start = clamma_timestamp_ns();
+
+			clamma_mutex_lock(&cw->mut_stream);
+			r = clamma_atomic_load(&sl->ready);
+			if (!r)
+				sl->ready_waiters++;
+			clamma_mutex_unlock(&cw->mut_stream);
+			if (!r) {
+				clamma_sem_wait(&sl->sem_ready);
+				r = clamma_atomic_load(&sl->ready);
+			}
+			clamma_atomic_add64(&cw->cwc_stall_ns,
+					    clamma_timestamp_ns() - start);
+			clamma_atomic_add64(&cw->cwc_stalls, 1);
+		}
+#endif
+
+		if (r != 1) {
+			cws_unref(sl);
+			return NULL;
+		}
+
+		clamma_atomic_add64(&cw->cwc_touched, size);
+
+		return sl->buf + sl->ofs[n];
+	}
+
+	return NULL;
+}
+
+/*
+ * The two slabs follow a single forward pass through the layers, so while t
+ * is streaming, the passes of several stepping threads on it take turns.
+ * Returns whether it took the turn, to give to clamma_weight_stream_pass_end().
+ */
+
+int
+clamma_weight_stream_pass_begin(const txf_t *t)
+{
+#if defined(LIBCLAMMA_SMP)
+	if (!t->stream)
+		return 0;
+
+	clamma_mutex_lock(&t->cwc->mut_pass);
+
+	return 1;
+#else
+	(void)t;
+
+	return 0;
+#endif
+}
+
+void
+clamma_weight_stream_pass_end(const txf_t *t, int locked)
+{
+#if defined(LIBCLAMMA_SMP)
+	if (locked)
+		clamma_mutex_unlock(&t->cwc->mut_pass);
+#else
+	(void)t;
+	(void)locked;
+#endif
+}
+
+/*
+ * Switch t to streaming its layers through two slabs, instead of caching them
+ */
+
+int
+clamma_txf_weight_stream(txf_t *t, int enable)
+{
+	cwc_state_t *cw = t->cwc;
+	clamma_wref_t w[CLAMMA_LAYER_WEIGHTS_MAX];
+	unsigned int l, n, c;
+	size_t size = 0;
+
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE ||
+	    (enable && t->shm))
+		return 1;
+
+	if (!enable) {
+		if (!t->stream)
+			return 0;
+
+		t->stream = 0;
+		clamma_weight_cache_prefetch_cancel(t);
+
+		for (n = 0; n < CLAMMA_ARRAY_SIZE(cw->slab); n++) {
+			cw->slab[n].stage = -1;
+			cws_drain(&cw->slab[n]);
+			cwc_afree(cw->slab[n].buf);
+			cw->slab[n].buf = NULL;
+			cw->slab[n].stage = -1;
+		}
+
+		return 0;
+	}
+
+	if (t->stream)
+		return 0;
+
+	/*
+	 * The slabs must fit the biggest layer, which may be the classifier,
+	 * with each tensor aligned and padded for O_DIRECT
+	 */
+
+	for (l = 0; l <= t->c.n_layers; l++) {
+		size_t sz = 0;
+
+		c = clamma_layer_weights(t, l, w);
+		for (n = 0; n < c; n++)
+			sz += w[n].len + 2 * CLAMMA_DIRECT_ALIGN;
+		if (sz > size)
+			size = sz;
+	}
+
+	for (n = 0; n < CLAMMA_ARRAY_SIZE(cw->slab); n++) {
+		/* the semaphores stay, they live as long as the cache */
+		cw->slab[n].count = 0;
+		cw->slab[n].seq = 0;
+		cw->slab[n].ready = 0;
+		cw->slab[n].stage = -1;
+		cw->slab[n].buf = cwc_aalloc(size);
+		if (!cw->slab[n].buf) {
+			fprintf(stderr, "%s: unable to allocate 2 x %lluMB\n",
+					__func__, (unsigned long long)size >> 20);
+			cwc_afree(cw->slab[0].buf);
+			cw->slab[0].buf = NULL;
+			return 1;
+		}
+	}
+
+	cw->slab_size	= size;
+	t->stream	= 1;
+
+	fprintf(stderr, "%s: streaming with 2 x %llu.%03lluMB slabs\n",
+			__func__, (unsigned long long)size / (1024 * 1024),
+			((unsigned long long)size % (1024 * 1024)) / 1000);
+
+	return 0;
+}
+
+/*
+ * Read t's weights with O_DIRECT, so they are only in memory once, in the
+ * cache, and not in the page cache as well.  Call it before using the model.
+ * If the filesystem can't do it, t stays on buffered reads and we return 1.
+ */
+
+int
+clamma_txf_direct_io(txf_t *t, int enable)
+{
+#if defined(O_DIRECT) || defined(F_NOCACHE)
+	uint8_t *probe;
+	ssize_t ar;
+	int fl;
+
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE || t->stream)
+		return 1;
+
+	if (!enable == !t->direct)
+		return 0;
+
+#if defined(O_DIRECT)
+	fl = fcntl(t->fd, F_GETFL);
+	if (fl < 0 || fcntl(t->fd, F_SETFL,
+			    enable ? fl | O_DIRECT : fl & ~O_DIRECT) < 0)
+		goto fail;
+#else
+	(void)fl;
+	if (fcntl(t->fd, F_NOCACHE, enable) < 0)
+		goto fail;
+#endif
+	t->direct = (char)!!enable;
+
+	if (!enable)
+		return 0;
+
+	/* some filesystems accept the flag, but then fail the reads */
+
+	probe = cwc_aalloc(CLAMMA_DIRECT_ALIGN);
+	if (!probe)
+		goto fail;
+	ar = pread(t->fd, probe, CLAMMA_DIRECT_ALIGN, 0);
+	cwc_afree(probe);
+	if (ar > 0)
+		return 0;
+
+#if defined(O_DIRECT)
+	fcntl(t->fd, F_SETFL, fl);
+#else
+	fcntl(t->fd, F_NOCACHE, 0);
+#endif
+	t->direct = 0;
+
+fail:
+	fprintf(stderr, "%s: %s: no direct io, using page cache\n",
+			__func__, t->name);
+#else
+	(void)t;
+	(void)enable;
+#endif
+
+	return 1;
+}
+
+/*
+ * Returns a pinned pointer to the cached weights, the caller must give it
+ * back with clamma_weight_cache_release() when it's done with it.
+ */
 
 const void *
 clamma_weight_cache(const txf_t *t, const void *weight, size_t size)
 {
-	void *ret = NULL;
-	uint64_t ofs;
-	ssize_t ar;
-	cwc_t *c;
+	const void *p;
 
-	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE)
+	/* attached weights are already in (shared) memory */
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE || t->shm)
 		return weight;
 
-	c = cwc.cwc_head;
-	ofs = (uint64_t)((uint8_t *)weight - ((uint8_t *)t->data));
+	if (t->stream) {
+		p = cws_lookup(t, weight, size);
+		if (p)
+			return p;
+	}
+
+	return cwc_get(t, weight, size);
+}
+
+/*
+ * Drop the pin taken by clamma_weight_cache()
+ */
+
+void
+clamma_weight_cache_release(const txf_t *t, const void *cached)
+{
+	cwc_state_t *cw = t->cwc;
+	cwc_t *c;
+
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE || t->shm ||
+	    !cached)
+		return;
+
+	for (unsigned int n = 0; n < CLAMMA_ARRAY_SIZE(cw->slab); n++)
+		if (cw->slab[n].buf && (uint8_t *)cached >= cw->slab[n].buf &&
+		    (uint8_t *)cached < cw->slab[n].buf + cw->slab_size) {
+			cws_unref(&cw->slab[n]);
+			return;
+		}
+
+	c = ((cwc_t **)cached)[-1];
+	assert(clamma_atomic_load(&c->refcount) > 0);
+	clamma_atomic_add(&c->refcount, -1);
+}
 
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_lock(&cwc.mut_cwc);
-#endif
 
-	while (c) {
-		if (c->offset == ofs && c->len == size) {
-			c->count++;
-			goto hit;
+/*
+ * The prefetch thread loads the weights for the layer after the one being
+ * computed, so in steady state the kernels find their weights already there.
+ * Requests just overwrite the single pending slot, if we fall behind we skip
+ * to the latest one.
+ */
+
+static void
+cwc_prefetch_done(cwc_read_t *rd)
+{
+	cwc_t *c = (cwc_t *)rd->opaque;
+
+	cwc_loaded(c, !rd->result);
+	clamma_atomic_add(&c->refcount, -1);
+}
+
+void *
+clamma_weight_prefetch_worker(void *tp)
+{
+	clamma_wref_t w[CLAMMA_LAYER_WEIGHTS_MAX];
+	cwc_read_t rd[CLAMMA_LAYER_WEIGHTS_MAX];
+	cwc_state_t *cw = (cwc_state_t *)tp;
+	cwc_prefetch_t *pf = &cw->pf;
+
+	while (1) {
+		unsigned int l, n, c, b;
+		const txf_t *t;
+
+		clamma_sem_wait(&pf->sem);
+		if (pf->exiting)
+			break;
+
+		clamma_mutex_lock(&pf->mut);
+		t = pf->t;
+		l = pf->layer;
+		pf->t = NULL;
+		pf->busy = t;
+		clamma_mutex_unlock(&pf->mut);
+
+		if (!t)
+			continue;
+
+		if (t->stream) {
+			cws_slab_t *sl;
+
+			/* fill any assigned slabs, oldest request first */
+
+			do {
+				clamma_mutex_lock(&cw->mut_stream);
+				sl = NULL;
+				for (n = 0; n < CLAMMA_ARRAY_SIZE(cw->slab); n++)
+					if (cw->slab[n].stage >= 0 &&
+					    !clamma_atomic_load(&cw->slab[n].ready) &&
+					    (!sl || cw->slab[n].seq < sl->seq))
+						sl = &cw->slab[n];
+				if (sl)
+					/* hold it so it can't be reassigned */
+					clamma_atomic_add(&sl->refcount, 1);
+				clamma_mutex_unlock(&cw->mut_stream);
+
+				if (sl) {
+					cws_fill(t, sl);
+					cws_unref(sl);
+				}
+			} while (sl && !pf->exiting);
+
+			goto done;
 		}
-		c = c->next;
-	}
 
-	if (t->cache_limit)
-		while (cwc.cwc_alloced > t->cache_limit) {
-			c = cwc.cwc_head->next;
-			cwc.cwc_alloced -= cwc.cwc_head->len;
-			free(cwc.cwc_head);
-			cwc.cwc_head = c;
+		/* claim what isn't cached yet, then read it all in one go */
+
+		c = clamma_layer_weights(t, l, w);
+		for (n = 0, b = 0; n < c && !pf->exiting; n++) {
+			uint64_t ofs = (uint64_t)((uint8_t *)w[n].p -
+						  (uint8_t *)t->data);
+			cwc_t *ce;
+
+			if (cwc_claim(t, ofs, w[n].len, 1, &ce))
+				cwc_entry_read(ce, &rd[b++]);
 		}
-	c = malloc(sizeof(*c) + size);
-	if (!c) {
-		fprintf(stderr, "%s: allocate %llu size failed\n",
-				__func__, (unsigned long long)size);
-		goto bail;
+		cwc_read_batch(t, rd, b, cwc_prefetch_done);
+
+done:
+		clamma_mutex_lock(&pf->mut);
+		pf->busy = NULL;
+		clamma_mutex_unlock(&pf->mut);
 	}
 
-	c->offset = ofs;
-	c->len = size;
-	c->count = 1;
-	c->next = cwc.cwc_head;
+	return NULL;
+}
 
-	cwc.cwc_head = c;
-	cwc.cwc_created++;
-	cwc.cwc_alloced += size;
-	cwc.cwc_fetched += size;
+#endif
 
-	lseek(t->fd, ofs, SEEK_SET);
-	ar = read(t->fd, (uint8_t *)c + sizeof(*c), size);
-	if (ar != (ssize_t)size) {
-		fprintf(stderr, "asked to read %d, read %d\n",
-				(int)size, (int)ar);
-		goto bail;
+/*
+ * Ask for layer l's weights to be loaded in the background, the forward pass
+ * calls this for layer l + 1 at the start of layer l.  In MMAP mode that's a
+ * readahead hint for the page cache.
+ */
+
+void
+clamma_weight_cache_prefetch(const txf_t *t, unsigned int l)
+{
+#if defined(LIBCLAMMA_SMP)
+	cwc_state_t *cw = t->cwc;
+#endif
+
+	if (t->model_access == CLAMMA_MODEL_ACCESS_MMAP) {
+		/* the kernel does it for us, just tell it what's next */
+		clamma_mmap_willneed(t, l);
+		return;
 	}
 
-hit:
-	cwc.cwc_touched += size;
-	ret = (uint8_t *)c + sizeof(*c);
+	if (t->model_access != CLAMMA_MODEL_ACCESS_MALLOC_CACHE || t->shm)
+		return;
+
+	if (t->stream) {
+		cws_slab_t *sl = cws_request(t, l);
+
+		if (!sl)
+			return;
+#if defined(LIBCLAMMA_SMP)
+		if (cw->pf.running)
+			goto post;
+#endif
+		/* no prefetch thread, just fill it inline */
+		cws_fill(t, sl);
+
+		return;
+	}
 
-bail:
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_unlock(&cwc.mut_cwc);
+	if (!t->prefetch || !cw->pf.running)
+		return;
+
+post:
+	clamma_mutex_lock(&cw->pf.mut);
+	cw->pf.t = t;
+	cw->pf.layer = l;
+	clamma_mutex_unlock(&cw->pf.mut);
+
+	clamma_sem_post(&cw->pf.sem);
 #endif
+}
+
+/*
+ * Make sure the prefetcher is not holding or working on t, before it goes away
+ */
+
+void
+clamma_weight_cache_prefetch_cancel(const txf_t *t)
+{
+#if defined(LIBCLAMMA_SMP)
+	cwc_state_t *cw = t->cwc;
 
-	return ret;
+	if (!cw || !cw->pf.running)
+		return;
+
+	while (1) {
+		int busy;
+
+		clamma_mutex_lock(&cw->pf.mut);
+		if (cw->pf.t == t)
+			cw->pf.t = NULL;
+		busy = cw->pf.busy == t;
+		clamma_mutex_unlock(&cw->pf.mut);
+
+		if (!busy)
+			break;
+
+		usleep(1000);
+	}
+#else
+	(void)t;
+#endif
 }
 
+/*
+ * Set a limit on the weights cached by all the models in the process together,
+ * or 0 for no limit.  Each model's own cache_limit still applies as well.
+ */
+
 void
-clamma_weight_cache_init(void)
+clamma_weight_cache_budget(size_t bytes)
+{
+	cwc_budget = bytes;
+}
+
+/*
+ * Called once the model layout is known, to index which layer and class of
+ * tensor each weight extent is
+ */
+
+int
+clamma_weight_cache_index(txf_t *t)
+{
+	clamma_wref_t w[CLAMMA_LAYER_WEIGHTS_MAX];
+	cwc_state_t *cw = t->cwc;
+	unsigned int l, n, c;
+
+	if (!cw)
+		return 0;
+
+	cw->pin = malloc(t->c.n_layers + 1);
+	cw->ix = malloc((t->c.n_layers + 1) * CLAMMA_LAYER_WEIGHTS_MAX *
+			sizeof(*cw->ix));
+	if (!cw->pin || !cw->ix) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		free(cw->pin);
+		free(cw->ix);
+		cw->pin = NULL;
+		cw->ix = NULL;
+		return 1;
+	}
+	memset(cw->pin, 0, t->c.n_layers + 1);
+
+	cw->ix_count = 0;
+	for (l = 0; l <= t->c.n_layers; l++) {
+		c = clamma_layer_weights(t, l, w);
+		for (n = 0; n < c; n++) {
+			cwc_ix_t *ix = &cw->ix[cw->ix_count++];
+
+			ix->ofs		= (uint64_t)((uint8_t *)w[n].p -
+						     (uint8_t *)t->data);
+			ix->len		= w[n].len;
+			ix->layer	= (uint16_t)l;
+			ix->cls		= w[n].cls;
+		}
+	}
+
+	qsort(cw->ix, cw->ix_count, sizeof(*cw->ix), cwc_ix_cmp);
+
+	return 0;
+}
+
+const char *
+clamma_weight_class_name(clamma_wclass_t cls)
+{
+	static const char * const names[] = {
+		"other", "rms", "wq", "wk", "wv", "wo", "w1", "w2", "w3", "cls"
+	};
+
+	if ((unsigned int)cls >= CLAMMA_ARRAY_SIZE(names))
+		return "?";
+
+	return names[cls];
+}
+
+/*
+ * Snapshot of t's cache stats, they are cumulative except resident
+ */
+
+int
+clamma_weight_cache_stats(const txf_t *t, clamma_wc_stats_t *st)
+{
+	cwc_state_t *cw = t->cwc;
+	unsigned int n;
+
+	memset(st, 0, sizeof(*st));
+	if (!cw)
+		return 1;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&cw->mut_cwc);
+#endif
+	for (n = 0; n < CLAMMA_WCLASS_COUNT; n++) {
+		clamma_wc_class_stats_t *s = &st->cls[n];
+
+		s->hits		= clamma_atomic_load(&cw->cs[n].hits);
+		s->misses	= clamma_atomic_load(&cw->cs[n].misses);
+		s->stall_ns	= clamma_atomic_load(&cw->cs[n].stall_ns);
+		s->bytes_read	= cw->cs[n].bytes_read;
+		s->evictions	= cw->cs[n].evictions;
+		s->resident	= cw->cs[n].resident;
+
+		st->total.hits		+= s->hits;
+		st->total.misses	+= s->misses;
+		st->total.stall_ns	+= s->stall_ns;
+		st->total.bytes_read	+= s->bytes_read;
+		st->total.evictions	+= s->evictions;
+		st->total.resident	+= s->resident;
+	}
+	st->entries = cw->count;
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_cwc);
+#endif
+
+	st->lock_wait_ns	= clamma_atomic_load(&cw->lock_wait_ns);
+	st->cache_limit		= t->cache_limit;
+	st->arena_mapped	= cw->arena.mapped;
+	if (cw->pin)
+		for (n = 0; n <= t->c.n_layers; n++)
+			st->pinned_layers += !!cw->pin[n];
+
+	return 0;
+}
+
+/*
+ * Change t's cache limit while it's running, 0 means no limit.  If it shrank,
+ * we evict down to it now, as far as the pins allow.
+ */
+
+int
+clamma_weight_cache_limit(txf_t *t, size_t limit)
+{
+	cwc_state_t *cw = t->cwc;
+
+	if (!cw)
+		return 1;
+
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_lock(&cw->mut_cwc);
+#endif
+	t->cache_limit = limit;
+	if (limit)
+		cwc_evict(cw, limit, 0);
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_unlock(&cw->mut_cwc);
+#endif
+
+	return 0;
+}
+
+/*
+ * Keep layer l's weights (l = n_layers is the classifier) in the cache, or let
+ * them be evicted again.  Pinning loads the layer now, if it isn't already.
+ */
+
+int
+clamma_weight_cache_pin_layer(txf_t *t, unsigned int l, int pin)
+{
+	clamma_wref_t w[CLAMMA_LAYER_WEIGHTS_MAX];
+	cwc_state_t *cw = t->cwc;
+	unsigned int n, c;
+	const void *p;
+
+	if (!cw || !cw->pin || l > t->c.n_layers)
+		return 1;
+
+	cw->pin[l] = (uint8_t)!!pin;
+	if (!pin)
+		return 0;
+
+	c = clamma_layer_weights(t, l, w);
+	for (n = 0; n < c; n++) {
+		p = cwc_get(t, w[n].p, w[n].len);
+		if (!p)
+			return 1;
+		clamma_weight_cache_release(t, p);
+	}
+
+	return 0;
+}
+
+/*
+ * Create t's cache, and its prefetch thread
+ */
+
+int
+clamma_weight_cache_init(txf_t *t)
 {
+	cwc_state_t *cw = malloc(sizeof(*cw));
+
+	if (!cw) {
+		fprintf(stderr, "%s: OOM\n", __func__);
+		return 1;
+	}
+
+	memset(cw, 0, sizeof(*cw));
+	cw->slab[0].stage = cw->slab[1].stage = -1;
+	cw->ring.fd = -1;
+#if defined(CLAMMA_IO_URING)
+	if (cwc_ring_init(&cw->ring))
+		fprintf(stderr, "%s: no io_uring, using pread\n", __func__);
+#endif
+
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_init(&cwc.mut_cwc);
+	for (unsigned int n = 0; n < CLAMMA_CWC_HASH; n++)
+		clamma_mutex_init(&cw->bucket[n].mut);
+
+	clamma_mutex_init(&cw->mut_cwc);
+	clamma_mutex_init(&cw->mut_fd);
+	clamma_mutex_init(&cw->mut_stream);
+	clamma_mutex_init(&cw->mut_pass);
+	clamma_mutex_init(&cw->arena.mut);
+	for (unsigned int n = 0; n < CLAMMA_ARRAY_SIZE(cw->slab); n++) {
+		clamma_sem_init(&cw->slab[n].sem_idle);
+		clamma_sem_init(&cw->slab[n].sem_ready);
+	}
+
+	clamma_mutex_init(&cw->pf.mut);
+	if (!clamma_sem_init(&cw->pf.sem) &&
+	    !clamma_smp_thread_create(&cw->pf.pt,
+				      clamma_weight_prefetch_worker, cw))
+		cw->pf.running = 1;
 #endif
+
+	t->cwc = cw;
+
+	return 0;
 }
 
 void
-clamma_weight_cache_deinit(void)
+clamma_weight_cache_deinit(txf_t *t)
 {
+	cwc_state_t *cw = t->cwc;
+
+	if (!cw)
+		return;
+
 #if defined(LIBCLAMMA_SMP)
-	clamma_mutex_destroy(&cwc.mut_cwc);
+	if (cw->pf.running) {
+		cw->pf.exiting = 1;
+		clamma_sem_post(&cw->pf.sem);
+		clamma_smp_thread_join(cw->pf.pt);
+		cw->pf.running = 0;
+	}
+	clamma_sem_destroy(&cw->pf.sem);
+	clamma_mutex_destroy(&cw->pf.mut);
+
+	for (unsigned int n = 0; n < CLAMMA_CWC_HASH; n++)
+		clamma_mutex_destroy(&cw->bucket[n].mut);
+
+	clamma_mutex_destroy(&cw->mut_cwc);
+	clamma_mutex_destroy(&cw->mut_fd);
+	clamma_mutex_destroy(&cw->mut_stream);
+	clamma_mutex_destroy(&cw->mut_pass);
+	for (unsigned int n = 0; n < CLAMMA_ARRAY_SIZE(cw->slab); n++) {
+		clamma_sem_destroy(&cw->slab[n].sem_idle);
+		clamma_sem_destroy(&cw->slab[n].sem_ready);
+	}
+#endif
+#if defined(CLAMMA_IO_URING)
+	cwc_ring_deinit(&cw->ring);
+#endif
+
+	/* what's left in the arena after clearing is the spare chunks */
+
+	for (unsigned int n = 0; n < CLAMMA_CWA_CLASSES; n++)
+		while (cw->arena.cls[n].chunks)
+			cwa_chunk_destroy(&cw->arena, cw->arena.cls[n].chunks);
+#if defined(LIBCLAMMA_SMP)
+	clamma_mutex_destroy(&cw->arena.mut);
+#endif
+
+	free(cw->ix);
+	free(cw->pin);
+	free(cw);
+	t->cwc = NULL;
+}
+
+/*
+ * Process resident set size, or 0 if we can't tell
+ */
+
+static uint64_t
+cwa_rss(void)
+{
+#if defined(__linux__)
+	unsigned long long size, res = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%llu %llu", &size, &res) != 2)
+		res = 0;
+	fclose(f);
+
+	return (uint64_t)res * (uint64_t)sysconf(_SC_PAGESIZE);
+#else
+	return 0;
 #endif
 }
 
+/*
+ * Report t's cache stats and empty it
+ */
+
 void
-clamma_weight_cache_clear(void)
+clamma_weight_cache_clear(const txf_t *t)
 {
-	cwc_t *c = cwc.cwc_head, *c1;
+	cwc_state_t *cw = t->cwc;
 
-	fprintf(stderr, "    cwc: created: %d, fetched: %lluM, touched: %lluM\n",
-			cwc.cwc_created,
-			(unsigned long long)cwc.cwc_fetched / (1024 * 1024),
-			(unsigned long long)cwc.cwc_touched / (1024 * 1024));
+	if (!cw)
+		return;
 
-	while (c) {
-		c1 = c;
-		c = c->next;
-		free(c1);
+	fprintf(stderr, "    cwc: %s: created: %d, fetched: %lluM, "
+			"touched: %lluM, evicted: %llu\n"
+			"         prefetched: %lluM (skipped %llu), "
+			"stalls: %llu (%llums)\n",
+			t->name, cw->cwc_created,
+			(unsigned long long)cw->cwc_fetched / (1024 * 1024),
+			(unsigned long long)cw->cwc_touched / (1024 * 1024),
+			(unsigned long long)cw->cwc_evicted,
+			(unsigned long long)cw->cwc_prefetched / (1024 * 1024),
+			(unsigned long long)cw->cwc_prefetch_skipped,
+			(unsigned long long)cw->cwc_stalls,
+			(unsigned long long)cw->cwc_stall_ns / 1000000ull);
+
+	if (cw->stream_ns)
+		fprintf(stderr, "         streamed: %lluM, %llu.%03lluMB/s\n",
+			(unsigned long long)cw->stream_bytes / (1024 * 1024),
+			(unsigned long long)((cw->stream_bytes * 1000ull) /
+					     cw->stream_ns),
+			(unsigned long long)(((cw->stream_bytes * 1000000ull) /
+					     cw->stream_ns) % 1000));
+
+	if (cw->arena.mapped)
+		fprintf(stderr, "         arena: %lluM mapped, %lluM in use, "
+				"%lluM free, %llu%% overhead, "
+				"%llu / %llu reused, rss %lluM\n",
+			(unsigned long long)cw->arena.mapped / (1024 * 1024),
+			(unsigned long long)cw->arena.in_use / (1024 * 1024),
+			(unsigned long long)cw->arena.free / (1024 * 1024),
+			(unsigned long long)(((cw->arena.mapped -
+					       cw->arena.in_use) * 100) /
+					     cw->arena.mapped),
+			(unsigned long long)cw->arena.reused,
+			(unsigned long long)cw->arena.allocs,
+			(unsigned long long)cwa_rss() / (1024 * 1024));
+
+	for (unsigned int n = 0; n < CLAMMA_WCLASS_COUNT; n++)
+		if (cw->cs[n].hits || cw->cs[n].misses)
+			fprintf(stderr, "         %5s: hits %llu, misses %llu "
+					"(%llums), read %lluM, evicted %llu\n",
+				clamma_weight_class_name((clamma_wclass_t)n),
+				(unsigned long long)cw->cs[n].hits,
+				(unsigned long long)cw->cs[n].misses,
+				(unsigned long long)cw->cs[n].stall_ns / 1000000ull,
+				(unsigned long long)cw->cs[n].bytes_read /
+								(1024 * 1024),
+				(unsigned long long)cw->cs[n].evictions);
+
+	while (cw->hand) {
+		cwc_t *c = cw->hand;
+
+		cwc_ring_unlink(cw, c);
+		cwc_free(cw, c);
 	}
+
+	for (unsigned int n = 0; n < CLAMMA_CWC_HASH; n++)
+		cw->bucket[n].head = NULL;
+
+	for (unsigned int n = 0; n < CLAMMA_WCLASS_COUNT; n++)
+		cw->cs[n].resident = 0;
+
+	cwc_account(cw, cw->cwc_alloced, 0);
 }
+